@@ -29,6 +29,12 @@
  *
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "rc3600.h"
 
 /* From RCSL 52-AA894, Appendix A */
@@ -344,3 +350,159 @@ AutoRom(struct rc3600 *cs)
 	for(adr = 0; adr < 32; adr++)
 		core_write(cs, adr, autorom[adr], CORE_NULL);
 }
+
+/*
+ * Load an RC3600 binary paper-tape directly into core, as the autoload
+ * of it would have done, only without the paper-tape reader.
+ *
+ * Each segment on the tape is:
+ *
+ *	Zero leader and one non-zero frame, skipped by AutoRom D.
+ *	Big-endian count-word (negative, counts itself) and the rest of
+ *	    the stage one loader, which AutoRom D puts at 0100 and jumps
+ *	    into at its last word.
+ *	Count-prefixed relocating loader, which stage one copies to
+ *	    the top of core.  We skip that.
+ *	Little-endian blocks, skipping zero frames before each, of:
+ *	    cnt, addr, cksum, data, with cnt+addr+cksum+data == 0.
+ *	    -16 <= cnt < 0:	-cnt data words stored from addr.
+ *	    cnt < -16:		one data word stored -cnt-1 times.
+ *	    cnt > 1:		comment, skipped up to a 0xff frame.
+ *	    cnt = 0 or 1:	start block, addr is start address and
+ *				bit 15 means halt instead.
+ *
+ * Segments follow each other until a trailer which does not look like
+ * a stage one count-word.
+ */
+
+struct tape {
+	const uint8_t	*buf;
+	size_t		len;
+	size_t		ptr;
+};
+
+static void
+tape_skip_zero(struct tape *tp)
+{
+
+	while (tp->ptr < tp->len && tp->buf[tp->ptr] == 0)
+		tp->ptr++;
+}
+
+static int
+tape_word(struct tape *tp, int be, uint16_t *w)
+{
+
+	if (tp->ptr + 2 > tp->len)
+		return (-1);
+	if (be)
+		*w = tp->buf[tp->ptr] << 8 | tp->buf[tp->ptr + 1];
+	else
+		*w = tp->buf[tp->ptr] | tp->buf[tp->ptr + 1] << 8;
+	tp->ptr += 2;
+	return (0);
+}
+
+static int
+tape_segment(struct rc3600 *cs, struct cli *cli, struct tape *tp,
+    uint16_t *start)
+{
+	uint16_t cnt, adr, w = 0, sum;
+	unsigned u, n;
+	size_t blk;
+
+	tape_skip_zero(tp);
+	if (tp->ptr >= tp->len)
+		return (1);
+	tp->ptr++;
+	if (tape_word(tp, 1, &cnt) || !(cnt & 0x8000) ||
+	    0x10000 - cnt > 0300)
+		return (1);
+	n = 0x10000 - cnt;
+	for (u = 1; u < n; u++) {
+		if (tape_word(tp, 1, &w))
+			return (cli_error(cli, "Tape ends in stage one\n"));
+		core_write(cs, 0100 + u, w, CORE_NULL);
+	}
+	core_write(cs, 0100, 0, CORE_NULL);
+
+	/*
+	 * Depending on the stage one loader, the count-word is either
+	 * little- or big-endian.  Only one of them is a small negative
+	 * number.
+	 */
+	tape_skip_zero(tp);
+	if (tape_word(tp, 0, &cnt))
+		return (cli_error(cli, "No relocating loader on tape\n"));
+	if (cnt < 0x10000 - 0400)
+		cnt = cnt >> 8 | (cnt & 0xff) << 8;
+	if (cnt < 0x10000 - 0400)
+		return (cli_error(cli, "No relocating loader on tape\n"));
+	tp->ptr += 2 * (0x10000 - cnt);
+
+	while (1) {
+		tape_skip_zero(tp);
+		blk = tp->ptr;
+		if (tape_word(tp, 0, &cnt) || tape_word(tp, 0, &adr) ||
+		    tape_word(tp, 0, &sum))
+			return (cli_error(cli, "Tape ends in block\n"));
+		sum += cnt + adr;
+		if (!(cnt & 0x8000) && cnt > 1) {
+			while (tp->ptr < tp->len && tp->buf[tp->ptr] != 0xff)
+				tp->ptr++;
+			tp->ptr++;
+			continue;
+		}
+		if (!(cnt & 0x8000)) {
+			if (sum)
+				break;
+			*start = adr;
+			return (0);
+		}
+		n = 0x10000 - cnt;
+		for (u = 0; u < n; u++) {
+			if (u == 0 || n <= 16) {
+				if (tape_word(tp, 0, &w))
+					return (cli_error(cli,
+					    "Tape ends in block\n"));
+				sum += w;
+			}
+			if (n <= 16 || u < n - 1)
+				core_write(cs, adr + u, w, CORE_NULL);
+		}
+		if (sum)
+			break;
+	}
+	return (cli_error(cli, "Checksum error in block at 0x%zx\n", blk));
+}
+
+int
+tape_load(struct rc3600 *cs, struct cli *cli, const char *fn, uint16_t *start)
+{
+	struct tape tp;
+	struct stat st;
+	int fd, nseg = 0;
+	void *p;
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		return (cli_error(cli, "Cannot open %s: %s\n",
+		    fn, strerror(errno)));
+	AZ(fstat(fd, &st));
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	AZ(close(fd));
+	if (p == MAP_FAILED)
+		return (cli_error(cli, "Cannot map %s: %s\n",
+		    fn, strerror(errno)));
+	memset(&tp, 0, sizeof tp);
+	tp.buf = p;
+	tp.len = st.st_size;
+	while (!tape_segment(cs, cli, &tp, start))
+		nseg++;
+	AZ(munmap(p, st.st_size));
+	if (cli->status)
+		return (1);
+	if (nseg == 0)
+		return (cli_error(cli, "No program on tape %s\n", fn));
+	return (0);
+}
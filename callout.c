@@ -38,6 +38,7 @@ struct callout {
 	nanosec				when;
 	const struct callout_how	*how;
 	void				*priv;
+	callout_cb_f			*cb;
 };
 
 typedef void callout_func_f(const struct callout *);
@@ -74,11 +75,17 @@ static const struct callout_how callout_wake_dev_how = {
 	.func =				callout_func_wake_dev,
 };
 
-#if 0
-static const struct callout_how callout_callback = {
+static void
+callout_func_callback(const struct callout *co)
+{
+
+	co->cb(co->priv, co->when);
+}
+
+static const struct callout_how callout_callback_how = {
 	.name =				"Callback",
+	.func =				callout_func_callback,
 };
-#endif
 
 static void
 callout_insert(struct callout *co)
@@ -135,6 +142,34 @@ callout_dev_sleep_locked(struct iodev *iop, nanosec when)
 	AZ(pthread_cond_wait(&iop->sleep_cond, &iop->mtx));
 }
 
+/*
+ * Call func(priv, when) from the CPU thread 'when' nanoseconds of
+ * simulated time from now.  Callbacks cannot be cancelled, they must
+ * find out for themselves if they are still relevant.
+ * The CPU is woken up, if it idles, so it can see the new callout.
+ */
+
+void
+callout_callback(struct rc3600 *cs, nanosec when, callout_cb_f *func, void *priv)
+{
+	struct callout *co;
+
+	AN(func);
+	co = calloc(sizeof *co, 1);
+	AN(co);
+	co->cs = cs;
+	AZ(pthread_mutex_lock(&co->cs->run_mtx));
+	co->when = when + co->cs->sim_time;
+	AZ(pthread_mutex_unlock(&co->cs->run_mtx));
+	co->priv = priv;
+	co->cb = func;
+	co->how = &callout_callback_how;
+	callout_insert(co);
+	AZ(pthread_mutex_lock(&cs->run_mtx));
+	AZ(pthread_cond_signal(&cs->wait_cond));
+	AZ(pthread_mutex_unlock(&cs->run_mtx));
+}
+
 /**********************************************************************/
 
 static void
@@ -212,3 +247,23 @@ callout_poll(struct rc3600 *cs)
 		free(co);
 	}
 }
+
+/*
+ * Throw away the callouts of a machine which will never run again.
+ */
+
+void
+callout_flush(struct rc3600 *cs)
+{
+	struct callout *co;
+
+	AZ(pthread_mutex_lock(&cs->callout_mtx));
+	while (1) {
+		co = TAILQ_FIRST(&cs->callouts);
+		if (co == NULL)
+			break;
+		TAILQ_REMOVE(&cs->callouts, co, next);
+		free(co);
+	}
+	AZ(pthread_mutex_unlock(&cs->callout_mtx));
+}
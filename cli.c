@@ -118,6 +118,9 @@ cli_wait_halt(struct cli *cli)
 	}
 	while (cli->cs->running)
 		usleep(250000);
+	/* Let the CPU thread finish the HALT instruction */
+	AZ(pthread_mutex_lock(&cli->cs->running_mtx));
+	AZ(pthread_mutex_unlock(&cli->cs->running_mtx));
 }
 
 
@@ -154,6 +157,32 @@ cli_autoload(struct cli *cli)
 	}
 }
 
+static void v_matchproto_(cli_func_t)
+cli_load(struct cli *cli)
+{
+	uint16_t start;
+
+	if (cli->help) {
+		cli_printf(cli, "%s tape <filename>\n", cli->av[0]);
+		cli_printf(cli,
+		    "\t\tLoad binary paper-tape straight into core and start it\n");
+		return;
+	}
+
+	if (cli_n_args(cli, 2))
+		return;
+	if (strcasecmp(cli->av[1], "tape")) {
+		(void)cli_error(cli, "Unknown argument '%s'\n", cli->av[1]);
+		return;
+	}
+	cpu_stop(cli->cs);
+	if (tape_load(cli->cs, cli, cli->av[2], &start))
+		return;
+	cli->cs->pc = start & 0x7fff;
+	if (!(start & 0x8000))
+		cpu_start(cli->cs);
+}
+
 /**********************************************************************/
 
 static void v_matchproto_(cli_func_t)
@@ -255,13 +284,13 @@ exam_deposit_what(struct cli *cli,
 		*dst = &cli->cs->acc[0];
 	} else if (!strcasecmp(what, "ac1")) {
 		*fld = "AC1";
-		*dst = &cli->cs->acc[0];
+		*dst = &cli->cs->acc[1];
 	} else if (!strcasecmp(what, "ac2")) {
 		*fld = "AC2";
-		*dst = &cli->cs->acc[0];
+		*dst = &cli->cs->acc[2];
 	} else if (!strcasecmp(what, "ac3")) {
 		*fld = "AC3";
-		*dst = &cli->cs->acc[0];
+		*dst = &cli->cs->acc[3];
 	} else if (!strcasecmp(what, "pc")) {
 		*fld = "PC";
 		*dst = &cli->cs->pc;
@@ -477,6 +506,7 @@ static const struct cli_cmds {
 	{ "start",	cli_start },
 	{ "step",	cli_step },
 	{ "autoload",	cli_autoload },
+	{ "load",	cli_load },
 	{ "trace",	cli_trace },
 	{ "wait_halt",	cli_wait_halt },
 	{ "break",	cli_break },
@@ -491,6 +521,11 @@ static const struct cli_cmds {
 	{ "fdd",	cli_fdd },
 	{ "amx",	cli_amx },
 	{ "cdr",	cli_cdr },
+	{ "tmx",	cli_tmx },
+	{ "lpt",	cli_lpt },
+	{ "mt",		cli_mt },
+	{ "hft",	cli_hft },
+	{ "fpa",	cli_fpa },
 	{ "nodev",	cli_nodev },
 
 	{ "domus",	cli_domus },
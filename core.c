@@ -56,6 +56,15 @@ core_new(void)
 	return (cp);
 }
 
+void
+core_free(struct core *cp)
+{
+
+	AN(cp);
+	AZ(pthread_mutex_destroy(&cp->mtx));
+	free(cp);
+}
+
 const char *
 core_disass(const struct rc3600 *cs, uint16_t addr)
 {
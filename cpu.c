@@ -55,7 +55,6 @@ cpu_add_dev(struct iodev *iop, iodev_thr *thr)
 	AN(cs);
 	assert(0 <= iop->devno && iop->devno <= 62);
 	assert(cs->iodevs[iop->devno] == cs->nodev);
-	AN(iop->imask);
 	AZ(pthread_mutex_init(&iop->mtx, NULL));
 	AZ(pthread_cond_init(&iop->cond, NULL));
 	AZ(pthread_cond_init(&iop->sleep_cond, NULL));
@@ -120,8 +119,10 @@ cpu_thread(void *priv)
 	AZ(pthread_mutex_lock(&cs->run_mtx));
 	while (1) {
 		time_step = !cs->running;
-		while (!cs->running)
+		while (!cs->running && !cs->dying)
 			AZ(pthread_cond_wait(&cs->run_cond, &cs->run_mtx));
+		if (cs->dying)
+			break;
 		AZ(pthread_mutex_lock(&cs->running_mtx));
 		cs->real_time = now();
 		if (0) {
@@ -196,6 +197,8 @@ cpu_thread(void *priv)
 		}
 
 	}
+	AZ(pthread_mutex_unlock(&cs->run_mtx));
+	return (NULL);
 }
 
 static void
@@ -340,6 +343,40 @@ cpu_new(void)
 	return (cs);
 }
 
+/*
+ * Stop a machine for good and end its threads, when it turned out not
+ * to be wanted, such as a FPA peer whose script failed.  Its devices
+ * may still have sockets and files open which point back to it, so
+ * the rc3600 and iodev structures stay, but nothing runs any more.
+ */
+
+void
+cpu_destroy(struct rc3600 *cs)
+{
+	struct iodev *iop;
+	unsigned u;
+
+	AN(cs);
+	cpu_stop(cs);
+	AZ(pthread_mutex_lock(&cs->run_mtx));
+	cs->dying = 1;
+	AZ(pthread_mutex_unlock(&cs->run_mtx));
+	AZ(pthread_cond_signal(&cs->run_cond));
+	AZ(pthread_join(cs->cthread, NULL));
+
+	for (u = 0; u < IO_MAXDEV; u++) {
+		iop = cs->iodevs[u];
+		if (iop == cs->nodev || iop->thread == 0)
+			continue;
+		(void)pthread_cancel(iop->thread);
+		AZ(pthread_join(iop->thread, NULL));
+		iop->thread = 0;
+	}
+	callout_flush(cs);
+	core_free(cs->core);
+	cs->core = NULL;
+}
+
 void v_matchproto_(cli_func_f)
 cli_cpu(struct cli *cli)
 {
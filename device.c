@@ -236,9 +236,11 @@ struct dev_assignment {
 #define CNT_TXT "Digital Counter"
 #define ACU_TXT "Dial-up Controller"
 #define DKP_TXT "Moving Head Disc Channel"
+#define HFT_TXT "Host File Transfer (paravirtual)"
 
 static const struct dev_assignment default_assignments[] = {
 	{ "ASL",	0,	005,	-1,	ASL_TXT },
+	{ "HFT",	0,	007,	 6,	HFT_TXT },
 	{ "TTI",	0,	010,	14,	TTY_TXT },
 	{ "TTO",	0,	011,	15,	TTY_TXT },
 	{ "PTR",	0,	012,	11,	PTR_TXT },
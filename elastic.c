@@ -35,6 +35,11 @@
 #include "rc3600.h"
 #include "elastic.h"
 
+#define ELASTIC_IN_SIZE		(1 << 16)
+#define ELASTIC_CHUNK		256
+#define ELASTIC_TURBO_NSEC	10000
+#define ELASTIC_DRAIN_POLL	10000000	// nsec
+
 struct elastic *
 elastic_new(struct rc3600 *cs, int mode)
 {
@@ -43,59 +48,142 @@ elastic_new(struct rc3600 *cs, int mode)
 	AN(cs);
 	ep = calloc(1, sizeof *ep);
 	AN(ep);
-	TAILQ_INIT(&ep->chunks_in);
 	TAILQ_INIT(&ep->chunks_out);
 	TAILQ_INIT(&ep->subscribers);
 	AZ(pthread_mutex_init(&ep->mtx, NULL));
 	AZ(pthread_cond_init(&ep->cond_in, NULL));
 	AZ(pthread_cond_init(&ep->cond_out, NULL));
+	AZ(pthread_cond_init(&ep->cond_space, NULL));
+	if (mode != O_WRONLY) {
+		ep->in_size = ELASTIC_IN_SIZE;
+		ep->in_buf = malloc(ep->in_size);
+		AN(ep->in_buf);
+		ep->in_limit = ep->in_size;
+	}
+	ep->in_policy = EP_BLOCK;
+	ep->out_limit = SIZE_MAX;
+	ep->out_policy = EP_BLOCK;
 	assert(mode == O_RDONLY || mode == O_RDWR || mode == O_WRONLY);
 	ep->text = 1;
 	ep->mode = mode;
 	ep->cs = cs;
 	ep->bits_per_char = 8;
+	ep->burst = 1;
 	return (ep);
 }
 
 /* Output Subscriptions ***********************************************/
 
-static void *
-elastic_subscriber_thread(void *priv)
+static void
+elastic_reap(struct elastic *ep)
 {
-	struct elastic_subscriber *esp = priv;
-	struct elastic *ep = esp->ep;
 	struct chunk *cp;
 
-	AZ(pthread_mutex_lock(&ep->mtx));
 	while (1) {
-		while (!esp->die && TAILQ_EMPTY(&esp->chunks))
-			AZ(pthread_cond_wait(&esp->cond, &ep->mtx));
-		cp = TAILQ_FIRST(&esp->chunks);
-		if (cp != NULL)
-			TAILQ_REMOVE(&esp->chunks, cp, next);
-		AZ(pthread_mutex_unlock(&ep->mtx));
-		if (esp->die && cp == NULL)
+		cp = TAILQ_FIRST(&ep->chunks_out);
+		if (cp == NULL || !cp->sealed || cp->refcnt > 0)
 			break;
-		AN(cp);
-		AN(esp->func);
-		AN(esp->priv);
-		AN(cp->ptr);
-		AN(cp->len);
-		if (!esp->die)
-			esp->func(esp->priv, cp->ptr, cp->len);
-		free(cp->ptr);
+		TAILQ_REMOVE(&ep->chunks_out, cp, next);
+		ep->out_bytes -= cp->len;
 		free(cp);
+		AZ(pthread_cond_broadcast(&ep->cond_out));
+	}
+}
+
+/*
+ * Throw away the oldest output, subscribers which had not got to it
+ * yet skip ahead.  Chunks being delivered right now are left alone.
+ */
+
+static void
+elastic_drop_oldest(struct elastic *ep, size_t len)
+{
+	struct chunk *cp;
+	struct elastic_subscriber *esp;
+
+	while (ep->out_bytes + len > ep->out_limit) {
+		cp = TAILQ_FIRST(&ep->chunks_out);
+		if (cp == NULL || cp->busy)
+			break;
+		TAILQ_FOREACH(esp, &ep->subscribers, next) {
+			if (esp->cp == cp) {
+				esp->cp = TAILQ_NEXT(cp, next);
+				esp->off = 0;
+			}
+		}
+		TAILQ_REMOVE(&ep->chunks_out, cp, next);
+		ep->out_bytes -= cp->len;
+		ep->out_dropped += cp->len;
+		free(cp);
+	}
+}
+
+/*
+ * Called from the elastic loop thread
+ */
+
+void
+elastic_deliver(struct elastic_subscriber *esp)
+{
+	struct elastic *ep = esp->ep;
+	struct chunk *cp;
+	ssize_t len, sz;
+	int expired;
+
+	AZ(pthread_mutex_lock(&ep->mtx));
+	expired = esp->expired;
+	esp->expired = 0;
+	while (!esp->dead && !esp->stalled && esp->cp != NULL) {
+		cp = esp->cp;
+		cp->sealed = 1;
+		cp->busy++;
+		len = cp->len - esp->off;
+		AN(len);
+		AZ(pthread_mutex_unlock(&ep->mtx));
+		sz = esp->func(esp->priv, cp->ptr + esp->off, len);
 		AZ(pthread_mutex_lock(&ep->mtx));
+		cp->busy--;
+		assert(sz >= 0 && sz <= len);
+		if (sz < len) {
+			esp->off += sz;
+			esp->stalled = 1;
+			break;
+		}
+		esp->off = 0;
+		esp->cp = TAILQ_NEXT(cp, next);
+		assert(cp->refcnt > 0);
+		cp->refcnt--;
+		elastic_reap(ep);
 	}
-	AZ(pthread_cond_destroy(&esp->cond));
-	free(esp);
-	return (NULL);
+	if (expired && !esp->dead && esp->stalled) {
+		/* Keep it for when we get going again */
+		esp->expired = 1;
+	} else if (expired && !esp->dead) {
+		AZ(esp->cp);
+		AZ(pthread_mutex_unlock(&ep->mtx));
+		(void)esp->func(esp->priv, NULL, 0);
+		return;
+	}
+	AZ(pthread_mutex_unlock(&ep->mtx));
+}
+
+void
+elastic_subscriber_resume(struct elastic_subscriber *esp)
+{
+	struct elastic *ep = esp->ep;
+
+	AZ(pthread_mutex_lock(&ep->mtx));
+	esp->stalled = 0;
+	if (esp->cp != NULL || esp->expired)
+		elastic_loop_ready(esp);
+	AZ(pthread_mutex_unlock(&ep->mtx));
 }
 
 struct elastic_subscriber *
 elastic_subscribe(struct elastic *ep, elastic_deliver_f *func, void *priv)
 {
 	struct elastic_subscriber *esp;
+	struct chunk *cp;
 
 	assert(ep->mode != O_RDONLY);
 	esp = calloc(1, sizeof *esp);
@@ -103,52 +191,193 @@ elastic_subscribe(struct elastic *ep, elastic_deliver_f *func, void *priv)
 	esp->ep = ep;
 	esp->func = func;
 	esp->priv = priv;
-	AZ(pthread_cond_init(&esp->cond, NULL));
-	TAILQ_INIT(&esp->chunks);
 	AZ(pthread_mutex_lock(&ep->mtx));
 	TAILQ_INSERT_TAIL(&ep->subscribers, esp, next);
-	if (!TAILQ_EMPTY(&ep->chunks_out))
-		TAILQ_CONCAT(&esp->chunks, &ep->chunks_out, next);
+	/* Everything nobody has started on yet, is ours too */
+	TAILQ_FOREACH(cp, &ep->chunks_out, next) {
+		if (cp->sealed)
+			continue;
+		if (esp->cp == NULL)
+			esp->cp = cp;
+		cp->refcnt++;
+	}
+	if (esp->cp != NULL)
+		elastic_loop_ready(esp);
 	AZ(pthread_mutex_unlock(&ep->mtx));
-	AZ(pthread_create(&esp->thread, NULL, elastic_subscriber_thread, esp));
-	AZ(pthread_detach(esp->thread));
 	return (esp);
 }
 
+/*
+ * Give the subscriber a little time to be handed all output queued so
+ * far, before it goes away.  cond_out is only signalled when a chunk
+ * is freed, which other subscribers can hold up, so look again often.
+ */
+
+void
+elastic_subscriber_drain(struct elastic_subscriber *esp, nanosec timeout)
+{
+	struct elastic *ep = esp->ep;
+	struct timespec ts;
+	nanosec t, t1;
+
+	assert(!elastic_loop_self());
+	t1 = now() + timeout;
+	AZ(pthread_mutex_lock(&ep->mtx));
+	while (!esp->dead && esp->cp != NULL) {
+		t = now();
+		if (t >= t1)
+			break;
+		t += ELASTIC_DRAIN_POLL;
+		if (t > t1)
+			t = t1;
+		ts.tv_sec = t / 1000000000;
+		ts.tv_nsec = t % 1000000000;
+		(void)pthread_cond_timedwait(&ep->cond_out, &ep->mtx, &ts);
+	}
+	AZ(pthread_mutex_unlock(&ep->mtx));
+}
+
+/*
+ * Must not be called from the subscribers own deliver function.
+ */
+
 void
 elastic_unsubscribe(struct elastic *ep, struct elastic_subscriber *esp)
 {
+	struct chunk *cp;
 
 	AN(ep);
 	AN(esp);
+	elastic_loop_forget(esp);
 	AZ(pthread_mutex_lock(&ep->mtx));
-	esp->die = 1;
 	TAILQ_REMOVE(&ep->subscribers, esp, next);
+	for (cp = esp->cp; cp != NULL; cp = TAILQ_NEXT(cp, next)) {
+		assert(cp->refcnt > 0);
+		cp->refcnt--;
+	}
+	esp->cp = NULL;
+	elastic_reap(ep);
 	AZ(pthread_mutex_unlock(&ep->mtx));
-	AZ(pthread_cond_signal(&esp->cond));
+	free(esp);
 }
 
-/* Input injections ***************************************************/
+/* Input injections ***************************************************
+ *
+ * Input is kept in a bounded ring-buffer, and the device consumer can
+ * take as many bytes as it likes.  What happens to producers when it is
+ * full depends on in_policy.
+ * in_rd and in_wr are free-running, in_size is a power of two.
+ */
+
+#define elastic_in_used(ep)	((ep)->in_wr - (ep)->in_rd)
+
+/*
+ * How much can be injected without blocking
+ */
+
+size_t
+elastic_in_space(const struct elastic *ep)
+{
+
+	if (ep->in_policy == EP_DROP_OLDEST || ep->in_policy == EP_DROP_NEWEST)
+		return (ep->in_limit);
+	if (elastic_in_used(ep) >= ep->in_limit)
+		return (0);
+	return (ep->in_limit - elastic_in_used(ep));
+}
+
+void
+elastic_rx_notify(struct elastic *ep)
+{
+
+	if (ep->rx_func != NULL)
+		ep->rx_func(ep->rx_priv);
+}
 
 void
 elastic_inject(struct elastic *ep, const void *ptr, ssize_t len)
 {
-	struct chunk *cp;
+	const uint8_t *p = ptr;
+	size_t n, o;
+	int xoff;
 
 	if (len < 0)
 		len = strlen(ptr);
-	if (len == 0)
+	if (ep->in_buf == NULL)
 		return;
-	cp = calloc(1, sizeof *cp);
-	AN(cp);
-	cp->ptr = malloc(len);
-	AN(cp->ptr);
-	memcpy(cp->ptr, ptr, len);
-	cp->len = len;
 	AZ(pthread_mutex_lock(&ep->mtx));
-	TAILQ_INSERT_TAIL(&ep->chunks_in, cp, next);
-	AZ(pthread_cond_signal(&ep->cond_in));
+	while (len > 0) {
+		n = 0;
+		if (elastic_in_used(ep) < ep->in_limit)
+			n = ep->in_limit - elastic_in_used(ep);
+		if (n == 0 && ep->in_policy == EP_DROP_NEWEST) {
+			ep->in_dropped += len;
+			break;
+		}
+		if (n == 0 && ep->in_policy == EP_DROP_OLDEST) {
+			n = len < (ssize_t)ep->in_limit ? len : ep->in_limit;
+			ep->in_rd += n;
+			ep->in_dropped += n;
+		}
+		if (n == 0 && elastic_loop_self()) {
+			/*
+			 * The loop only reads what fits and stops polling
+			 * when full, so another producer got here first.
+			 * Never block the loop, go over the limit instead.
+			 */
+			n = ep->in_size - elastic_in_used(ep);
+			if (n == 0) {
+				ep->in_dropped += len;
+				break;
+			}
+		}
+		if (n == 0) {
+			AZ(pthread_mutex_unlock(&ep->mtx));
+			elastic_rx_notify(ep);
+			AZ(pthread_mutex_lock(&ep->mtx));
+			/* rx_func may have made room already */
+			if (elastic_in_used(ep) >= ep->in_limit)
+				AZ(pthread_cond_wait(&ep->cond_space,
+				    &ep->mtx));
+			continue;
+		}
+		if (n > (size_t)len)
+			n = len;
+		o = ep->in_wr & (ep->in_size - 1);
+		if (n > ep->in_size - o)
+			n = ep->in_size - o;
+		memcpy(ep->in_buf + o, p, n);
+		ep->in_wr += n;
+		p += n;
+		len -= n;
+		AZ(pthread_cond_signal(&ep->cond_in));
+	}
+	xoff = ep->in_policy == EP_XOFF && !ep->in_xoff &&
+	    elastic_in_used(ep) >= ep->in_limit - ep->in_limit / 4;
+	if (xoff)
+		ep->in_xoff = 1;
+	AZ(pthread_mutex_unlock(&ep->mtx));
+	elastic_rx_notify(ep);
+	if (xoff)
+		elastic_fd_flow(ep, 1);
+}
+
+/*
+ * Send XON when the device has eaten its way down to the low water mark
+ */
+
+static void
+elastic_in_xon(struct elastic *ep)
+{
+	int xon;
+
+	AZ(pthread_mutex_lock(&ep->mtx));
+	xon = ep->in_xoff && elastic_in_used(ep) <= ep->in_limit / 4;
+	if (xon)
+		ep->in_xoff = 0;
 	AZ(pthread_mutex_unlock(&ep->mtx));
+	if (xon)
+		elastic_fd_flow(ep, 0);
 }
 
 /* Driver Interface ***************************************************/
@@ -161,18 +390,64 @@ nsec_per_char(const struct elastic *ep)
 	return(ep->bits_per_char * 1000000000 / ep->bits_per_sec);
 }
 
-static struct chunk *
-mk_chunk(const void *ptr, ssize_t len)
+/*
+ * Token-bucket shaping in simulated time, in the "virtual scheduling"
+ * formulation: *tat is when the line will have sent everything so far.
+ * The first 'burst' characters go without delay, after that the line
+ * runs at bits_per_sec.  With burst=1 every character takes its full
+ * time, which is how the devices always behaved.
+ *
+ * Turbo still takes a little time per transfer, diagnostic programs
+ * expect to see devices busy right after they have been started.
+ */
+
+static nanosec
+elastic_shape(struct elastic *ep, nanosec *tat, unsigned nchar)
 {
-	struct chunk *cp;
+	nanosec t, tpc, d;
 
-	cp = calloc(1, sizeof *cp);
-	AN(cp);
-	cp->ptr = malloc(len);
-	AN(cp->ptr);
-	memcpy(cp->ptr, ptr, len);
-	cp->len = len;
-	return (cp);
+	if (ep->bits_per_sec <= 0)
+		return (0);
+	if (ep->turbo == ET_ON || (ep->turbo == ET_AUTO && ep->watchers == 0))
+		return (ELASTIC_TURBO_NSEC);
+	tpc = nsec_per_char(ep);
+	AZ(pthread_mutex_lock(&ep->cs->run_mtx));
+	t = ep->cs->sim_time;
+	AZ(pthread_mutex_unlock(&ep->cs->run_mtx));
+	AZ(pthread_mutex_lock(&ep->mtx));
+	if (*tat < t)
+		*tat = t;
+	*tat += nchar * tpc;
+	d = *tat - t - (nanosec)(ep->burst - 1) * tpc;
+	AZ(pthread_mutex_unlock(&ep->mtx));
+	return (d > 0 ? d : 0);
+}
+
+nanosec
+elastic_tx_delay(struct elastic *ep, unsigned nchar)
+{
+
+	return (elastic_shape(ep, &ep->tx_tat, nchar));
+}
+
+nanosec
+elastic_rx_delay(struct elastic *ep, unsigned nchar)
+{
+
+	return (elastic_shape(ep, &ep->rx_tat, nchar));
+}
+
+/*
+ * Device threads of a machine being torn down are cancelled while they
+ * wait in elastic_put() or elastic_get(), the elastic must survive it.
+ */
+
+static void
+elastic_unlock(void *priv)
+{
+	struct elastic *ep = priv;
+
+	AZ(pthread_mutex_unlock(&ep->mtx));
 }
 
 void
@@ -180,6 +455,7 @@ elastic_put(struct elastic *ep, const void *ptr, ssize_t len)
 {
 	struct chunk *cp;
 	struct elastic_subscriber *esp;
+	ssize_t sz;
 
 	assert(ep->mode != O_RDONLY);
 	if (len < 0)
@@ -187,14 +463,48 @@ elastic_put(struct elastic *ep, const void *ptr, ssize_t len)
 	if (len == 0)
 		return;
 	AZ(pthread_mutex_lock(&ep->mtx));
-	if (TAILQ_EMPTY(&ep->subscribers)) {
-		cp = mk_chunk(ptr, len);
-		TAILQ_INSERT_TAIL(&ep->chunks_out, cp, next);
-	} else {
-		TAILQ_FOREACH(esp, &ep->subscribers, next) {
-			cp = mk_chunk(ptr, len);
-			TAILQ_INSERT_TAIL(&esp->chunks, cp, next);
-			AZ(pthread_cond_signal(&esp->cond));
+	switch (ep->out_policy) {
+	case EP_DROP_OLDEST:
+		elastic_drop_oldest(ep, len);
+		break;
+	case EP_DROP_NEWEST:
+		if (ep->out_bytes > 0 && ep->out_bytes + len > ep->out_limit) {
+			ep->out_dropped += len;
+			AZ(pthread_mutex_unlock(&ep->mtx));
+			return;
+		}
+		break;
+	default:
+		pthread_cleanup_push(elastic_unlock, ep);
+		while (ep->out_bytes > 0 && ep->out_bytes + len > ep->out_limit)
+			AZ(pthread_cond_wait(&ep->cond_out, &ep->mtx));
+		pthread_cleanup_pop(0);
+		break;
+	}
+	ep->out_bytes += len;
+	cp = TAILQ_LAST(&ep->chunks_out, chunk_head);
+	if (cp != NULL && !cp->sealed && cp->size - cp->len >= len) {
+		/* Nobody has looked at it yet, tag along */
+		memcpy(cp->ptr + cp->len, ptr, len);
+		cp->len += len;
+		AZ(pthread_mutex_unlock(&ep->mtx));
+		return;
+	}
+	sz = len > ELASTIC_CHUNK ? len : ELASTIC_CHUNK;
+	cp = malloc(sizeof *cp + sz);
+	AN(cp);
+	memset(cp, 0, sizeof *cp);
+	cp->ptr = (uint8_t *)(cp + 1);
+	cp->size = sz;
+	memcpy(cp->ptr, ptr, len);
+	cp->len = len;
+	TAILQ_INSERT_TAIL(&ep->chunks_out, cp, next);
+	TAILQ_FOREACH(esp, &ep->subscribers, next) {
+		cp->refcnt++;
+		if (esp->cp == NULL) {
+			esp->cp = cp;
+			if (!esp->stalled)
+				elastic_loop_ready(esp);
 		}
 	}
 	AZ(pthread_mutex_unlock(&ep->mtx));
@@ -203,50 +513,192 @@ elastic_put(struct elastic *ep, const void *ptr, ssize_t len)
 ssize_t
 elastic_get(struct elastic *ep, void *ptr, ssize_t len)
 {
-	struct chunk *cp;
+	uint8_t *p = ptr;
+	size_t n, o;
+	ssize_t rv = 0;
+	int was_full;
 
 	assert(ep->mode != O_WRONLY);
 	AZ(pthread_mutex_lock(&ep->mtx));
-	while (TAILQ_EMPTY(&ep->chunks_in))
+	pthread_cleanup_push(elastic_unlock, ep);
+	while (ep->in_rd == ep->in_wr)
 		AZ(pthread_cond_wait(&ep->cond_in, &ep->mtx));
-	cp = TAILQ_FIRST(&ep->chunks_in);
-	if (cp->len - cp->read < len)
-		len = cp->len - cp->read;
-	memcpy(ptr, cp->ptr + cp->read, len);
-	cp->read += len;
-	if (cp->read == cp->len) {
-		TAILQ_REMOVE(&ep->chunks_in, cp, next);
-		free(cp->ptr);
-		free(cp);
+	pthread_cleanup_pop(0);
+	was_full = elastic_in_full(ep);
+	while (len > 0 && ep->in_rd != ep->in_wr) {
+		n = ep->in_wr - ep->in_rd;
+		if (n > (size_t)len)
+			n = len;
+		o = ep->in_rd & (ep->in_size - 1);
+		if (n > ep->in_size - o)
+			n = ep->in_size - o;
+		memcpy(p, ep->in_buf + o, n);
+		ep->in_rd += n;
+		p += n;
+		len -= n;
+		rv += n;
 	}
+	AZ(pthread_cond_broadcast(&ep->cond_space));
 	AZ(pthread_mutex_unlock(&ep->mtx));
-	return (len);
+	if (was_full)
+		elastic_loop_kick();
+	if (ep->in_xoff)
+		elastic_in_xon(ep);
+	return (rv);
 }
 
 int
 elastic_empty(const struct elastic *ep)
 {
-	return(TAILQ_EMPTY(&ep->chunks_in));
+	return(ep->in_rd == ep->in_wr);
 }
 
 static void
 elastic_drain(struct elastic *ep)
 {
-	struct chunk *cp;
 
 	AZ(pthread_mutex_lock(&ep->mtx));
-	while (!TAILQ_EMPTY(&ep->chunks_in)) {
-		cp = TAILQ_FIRST(&ep->chunks_in);
-		TAILQ_REMOVE(&ep->chunks_in, cp, next);
-		free(cp->ptr);
-		free(cp);
+	ep->in_rd = ep->in_wr;
+	AZ(pthread_cond_broadcast(&ep->cond_space));
+	AZ(pthread_mutex_unlock(&ep->mtx));
+	elastic_loop_kick();
+	if (ep->in_xoff)
+		elastic_in_xon(ep);
+}
+
+static const char * const elastic_turbos[] = {
+	[ET_OFF] =		"off",
+	[ET_ON] =		"on",
+	[ET_AUTO] =		"auto",
+};
+
+static const char * const elastic_policies[] = {
+	[EP_BLOCK] =		"block",
+	[EP_DROP_OLDEST] =	"drop-oldest",
+	[EP_DROP_NEWEST] =	"drop-newest",
+	[EP_XOFF] =		"xoff",
+};
+
+/*
+ * Change the input limit, growing the ring-buffer if need be.  If the
+ * limit shrinks below what is queued, the oldest input is dropped.
+ */
+
+static void
+elastic_in_limit(struct elastic *ep, size_t limit)
+{
+	uint8_t *nb;
+	size_t sz, n, u;
+
+	AZ(pthread_mutex_lock(&ep->mtx));
+	if (elastic_in_used(ep) > limit) {
+		n = elastic_in_used(ep) - limit;
+		ep->in_rd += n;
+		ep->in_dropped += n;
 	}
+	for (sz = ep->in_size; sz < limit; sz <<= 1)
+		continue;
+	if (sz != ep->in_size) {
+		nb = malloc(sz);
+		AN(nb);
+		n = elastic_in_used(ep);
+		for (u = 0; u < n; u++)
+			nb[u] = ep->in_buf[(ep->in_rd + u) & (ep->in_size - 1)];
+		free(ep->in_buf);
+		ep->in_buf = nb;
+		ep->in_size = sz;
+		ep->in_rd = 0;
+		ep->in_wr = n;
+	}
+	ep->in_limit = limit;
+	AZ(pthread_cond_broadcast(&ep->cond_space));
 	AZ(pthread_mutex_unlock(&ep->mtx));
+	elastic_loop_kick();
+}
+
+static void
+elastic_out_limit(struct elastic *ep, size_t limit)
+{
+
+	AZ(pthread_mutex_lock(&ep->mtx));
+	ep->out_limit = limit;
+	if (ep->out_policy == EP_DROP_OLDEST)
+		elastic_drop_oldest(ep, 0);
+	AZ(pthread_cond_broadcast(&ep->cond_out));
+	AZ(pthread_mutex_unlock(&ep->mtx));
+}
+
+static int
+cli_elastic_limit(struct elastic *ep, struct cli *cli)
+{
+	int in, u, n;
+	size_t limit;
+	char *e;
+
+	if (cli->ac < 2 ||
+	    (strcmp(cli->av[1], "in") && strcmp(cli->av[1], "out"))) {
+		(void)cli_error(cli,
+		    "Usage: limit {in|out} [<bytes> [<policy>]]\n");
+		return (cli->ac);
+	}
+	n = 2;
+	in = !strcmp(cli->av[1], "in");
+	if (in && ep->in_buf == NULL) {
+		(void)cli_error(cli, "Not an input\n");
+		return (n);
+	}
+	if (!in && ep->mode == O_RDONLY) {
+		(void)cli_error(cli, "Not an output\n");
+		return (n);
+	}
+	if (cli->ac > n && cli->av[n][0] >= '0' && cli->av[n][0] <= '9') {
+		limit = strtoul(cli->av[n], &e, 0);
+		if (*e != '\0' || limit == 0) {
+			(void)cli_error(cli, "Bad limit '%s'\n", cli->av[n]);
+			return (n + 1);
+		}
+		n++;
+		for (u = 0; cli->ac > n && u <= EP_XOFF; u++)
+			if (!strcmp(cli->av[n], elastic_policies[u]))
+				break;
+		if (cli->ac > n && u <= EP_XOFF) {
+			if (!in && u == EP_XOFF) {
+				(void)cli_error(cli,
+				    "Bad policy '%s'\n", cli->av[n]);
+				return (n + 1);
+			}
+			if (in)
+				ep->in_policy = u;
+			else
+				ep->out_policy = u;
+			n++;
+		}
+		if (in)
+			elastic_in_limit(ep, limit);
+		else
+			elastic_out_limit(ep, limit);
+	}
+	if (in)
+		cli_printf(cli,
+		    "in: %zu of %zu bytes used, %s, %ju dropped\n",
+		    elastic_in_used(ep), ep->in_limit,
+		    elastic_policies[ep->in_policy], ep->in_dropped);
+	else if (ep->out_limit == SIZE_MAX)
+		cli_printf(cli,
+		    "out: %zu bytes used, no limit, %ju dropped\n",
+		    ep->out_bytes, ep->out_dropped);
+	else
+		cli_printf(cli,
+		    "out: %zu of %zu bytes used, %s, %ju dropped\n",
+		    ep->out_bytes, ep->out_limit,
+		    elastic_policies[ep->out_policy], ep->out_dropped);
+	return (n);
 }
 
 int v_matchproto_(cli_elastic_f)
 cli_elastic(struct elastic *ep, struct cli *cli)
 {
+	int u;
 
 	AN(cli);
 	if (cli->help) {
@@ -260,10 +712,19 @@ cli_elastic(struct elastic *ep, struct cli *cli)
 		cli_printf(cli, "\t\tOutput bandwidth\n");
 		cli_printf(cli, "\tbaud <baud_rate>\n");
 		cli_printf(cli, "\t\tOutput bandwidth\n");
+		cli_printf(cli, "\tburst <characters>\n");
+		cli_printf(cli, "\t\tCharacters allowed ahead of the bandwidth\n");
+		cli_printf(cli, "\tturbo [on|off|auto]\n");
+		cli_printf(cli, "\t\tIgnore bandwidth, always or when no TELNET\n");
+		cli_printf(cli, "\t\tconnection is watching\n");
 		cli_printf(cli, "\t<< <string>\n");
 		cli_printf(cli, "\t\tInput <string> + CR into buffer\n");
+		cli_printf(cli, "\tlimit {in|out} [<bytes> [<policy>]]\n");
+		cli_printf(cli, "\t\tBuffer limit and what to do when reached:\n");
+		cli_printf(cli, "\t\tblock, drop-oldest, drop-newest or (in) xoff\n");
 		(void)cli_elastic_fd(NULL, cli);
 		(void)cli_elastic_tcp(NULL, cli);
+		(void)cli_elastic_local(NULL, cli);
 		(void)cli_elastic_match(NULL, cli);
 		return (0);
 	}
@@ -298,6 +759,40 @@ cli_elastic(struct elastic *ep, struct cli *cli)
 		cli->av++;
 		return(1);
 	}
+	if (!strcmp(*cli->av, "burst")) {
+		if (cli->ac != 1) {
+			if (cli_n_args(cli, 1))
+				return (1);
+			if (atoi(cli->av[1]) < 1)
+				return (cli_error(cli, "Burst must be >= 1\n"));
+			ep->burst = atoi(cli->av[1]);
+			cli->ac--;
+			cli->av++;
+		}
+		cli_printf(cli, "burst = %u\n", ep->burst);
+		cli->ac--;
+		cli->av++;
+		return(1);
+	}
+	if (!strcmp(*cli->av, "turbo")) {
+		if (cli->ac != 1) {
+			if (cli_n_args(cli, 1))
+				return (1);
+			for (u = 0; u <= ET_AUTO; u++)
+				if (!strcmp(cli->av[1], elastic_turbos[u]))
+					break;
+			if (u > ET_AUTO)
+				return (cli_error(cli,
+				    "Bad turbo '%s'\n", cli->av[1]));
+			ep->turbo = u;
+			cli->ac--;
+			cli->av++;
+		}
+		cli_printf(cli, "turbo = %s\n", elastic_turbos[ep->turbo]);
+		cli->ac--;
+		cli->av++;
+		return(1);
+	}
 	if (!strcmp(*cli->av, "text")) {
 		if (cli_n_args(cli, 0))
 			return (1);
@@ -325,6 +820,13 @@ cli_elastic(struct elastic *ep, struct cli *cli)
 		return (1);
 	}
 
+	if (!strcmp(*cli->av, "limit")) {
+		u = cli_elastic_limit(ep, cli);
+		cli->av += u;
+		cli->ac -= u;
+		return (1);
+	}
+
 	if (!strcmp(*cli->av, "<<")) {
 		if (ep->mode == O_WRONLY) {
 			return (cli_error(cli, "Only inputs can '<<'\n"));
@@ -343,6 +845,8 @@ cli_elastic(struct elastic *ep, struct cli *cli)
 		return (1);
 	if (cli_elastic_tcp(ep, cli))
 		return (1);
+	if (cli_elastic_local(ep, cli))
+		return (1);
 	if (cli_elastic_match(ep, cli))
 		return (1);
 	return (0);
@@ -31,51 +31,157 @@
 
 struct elastic_match;
 
-typedef void elastic_deliver_f(void *priv, const void *, size_t);
+/*
+ * Deliver functions are called from the elastic loop thread and must not
+ * block.  They return how many bytes they took, if that is less than
+ * offered, the subscriber stalls until elastic_subscriber_resume().
+ * A deliver function which wants to wait for time rather than for its
+ * file descriptor calls elastic_subscriber_hold() before returning short.
+ * When the hold expires, the function is called with len == 0 after
+ * everything pending has been delivered, which can be used to flush
+ * buffered output.
+ */
+typedef ssize_t elastic_deliver_f(void *priv, const void *, size_t);
+
+/*
+ * Devices which do not want a thread sitting in elastic_get() can have
+ * the rx function called when input arrives or carrier changes.  It is
+ * called without locks, from whichever thread caused it, and must not
+ * block.
+ */
+typedef void elastic_rx_f(void *priv);
+
+/*
+ * Devices which hold back output, like a printer collecting a line,
+ * can have the flush function called before the output file is closed
+ * or replaced, so that nothing is left behind.  It may block.
+ */
+typedef void elastic_flush_f(void *priv);
 
+/*
+ * Output chunks are shared by all subscribers.  A chunk stays open for
+ * more output until the first subscriber takes it, it is freed when
+ * the last subscriber is done with it.
+ */
 struct chunk {
 	TAILQ_ENTRY(chunk)		next;
 	uint8_t				*ptr;
 	ssize_t				len;
-	ssize_t				read;
+	ssize_t				size;
+	unsigned			refcnt;
+	unsigned			busy;	/* Being delivered */
+	int				sealed;
 };
 
+TAILQ_HEAD(chunk_head, chunk);
+
 struct elastic_subscriber {
 	TAILQ_ENTRY(elastic_subscriber)	next;
+	TAILQ_ENTRY(elastic_subscriber)	ready_list;
+	TAILQ_ENTRY(elastic_subscriber)	held_list;
 	struct elastic			*ep;
 	elastic_deliver_f		*func;
 	void				*priv;
-	pthread_t			thread;
-	int				die;
-	pthread_cond_t			cond;
-	TAILQ_HEAD(,chunk)		chunks;
+	int				dead;
+	int				queued;
+	int				stalled;
+	int				held;
+	int				expired;
+	nanosec				hold;	/* now() to resume at */
+	struct chunk			*cp;	/* Next to deliver */
+	ssize_t				off;	/* ... from here */
+};
+
+struct elastic_poll;
+typedef void elastic_poll_f(struct elastic_poll *, short revents);
+
+struct elastic_poll {
+	TAILQ_ENTRY(elastic_poll)	list;
+	int				fd;
+	short				events;
+	elastic_poll_f			*func;
+	void				*priv;
+	struct elastic			*rx_ep;	/* No POLLIN while full */
+	struct elastic_subscriber	*tx;	/* POLLOUT while stalled */
+	int				dead;
+};
+
+/*
+ * What to do when a buffer is at its limit.  XOFF only applies to
+ * input, it blocks like BLOCK, but also sends XOFF/XON to the serial
+ * ports and pseudo-terminals feeding it, at the high and low water
+ * marks.
+ */
+enum elastic_policy {
+	EP_BLOCK,
+	EP_DROP_OLDEST,
+	EP_DROP_NEWEST,
+	EP_XOFF,
+};
+
+enum elastic_turbo {
+	ET_OFF,
+	ET_ON,
+	ET_AUTO,	/* When nobody is watching over TELNET */
 };
 
 struct elastic {
 	struct rc3600			*cs;
 	TAILQ_HEAD(,elastic_subscriber)	subscribers;
-	TAILQ_HEAD(,chunk)		chunks_out;
-	TAILQ_HEAD(,chunk)		chunks_in;
+	struct chunk_head		chunks_out;
+	size_t				out_bytes;
+	size_t				out_limit;
+	enum elastic_policy		out_policy;
+	uintmax_t			out_dropped;
+	uint8_t				*in_buf;
+	size_t				in_size;	/* power of two */
+	size_t				in_rd;
+	size_t				in_wr;
+	size_t				in_limit;	/* <= in_size */
+	enum elastic_policy		in_policy;
+	uintmax_t			in_dropped;
+	int				in_xoff;
 	int				text;
 	int				mode;
 	nanosec				bits_per_char;
 	nanosec				bits_per_sec;
+	unsigned			burst;		/* characters */
+	enum elastic_turbo		turbo;
+	nanosec				tx_tat;
+	nanosec				rx_tat;
+	unsigned			watchers;
 	pthread_mutex_t			mtx;
 	pthread_cond_t			cond_in;
 	pthread_cond_t			cond_out;
+	pthread_cond_t			cond_space;
 
 	struct elastic_match		*em;
 	struct elastic_fd		*out;
 	unsigned			carrier;
+
+	elastic_rx_f			*rx_func;
+	void				*rx_priv;
+
+	elastic_flush_f			*flush_func;
+	void				*flush_priv;
 };
 
 struct elastic *elastic_new(struct rc3600 *, int mode);
 nanosec nsec_per_char(const struct elastic *ep);
+nanosec elastic_tx_delay(struct elastic *ep, unsigned nchar);
+nanosec elastic_rx_delay(struct elastic *ep, unsigned nchar);
 
 struct elastic_subscriber *elastic_subscribe(struct elastic *ep, elastic_deliver_f *, void *);
 void elastic_unsubscribe(struct elastic *ep, struct elastic_subscriber *);
+void elastic_subscriber_resume(struct elastic_subscriber *);
+void elastic_subscriber_hold(struct elastic_subscriber *, nanosec when);
+void elastic_subscriber_drain(struct elastic_subscriber *, nanosec timeout);
+void elastic_deliver(struct elastic_subscriber *);
 
 void elastic_inject(struct elastic *ep, const void *ptr, ssize_t len);
+void elastic_rx_notify(struct elastic *ep);
+size_t elastic_in_space(const struct elastic *ep);
+#define elastic_in_full(ep) (elastic_in_space(ep) == 0)
 
 void elastic_put(struct elastic *ep, const void *ptr, ssize_t len);
 ssize_t elastic_get(struct elastic *ep, void *ptr, ssize_t len);
@@ -86,9 +192,23 @@ typedef int cli_elastic_f(struct elastic *ep, struct cli *);
 cli_elastic_f cli_elastic;
 cli_elastic_f cli_elastic_tcp;
 cli_elastic_f cli_elastic_fd;
+cli_elastic_f cli_elastic_local;
 cli_elastic_f cli_elastic_match;
 
+#define ELASTIC_FD_SELFDESTRUCT	1
+#define ELASTIC_FD_XONXOFF	2
 struct elastic_fd *elastic_fd_start(
-    struct elastic *ep, int fd, int mode, int selfdestruct);
+    struct elastic *ep, int fd, int mode, int flags);
 void elastic_fd_stop(struct elastic_fd **efpp);
+void elastic_fd_flow(const struct elastic *, int xoff);
+
+void elastic_loop_kick(void);
+int elastic_loop_self(void);
+void elastic_loop_ready(struct elastic_subscriber *);
+void elastic_loop_forget(struct elastic_subscriber *);
+struct elastic_poll *elastic_poll_add(int fd, short events,
+    elastic_poll_f *func, void *priv,
+    struct elastic *rx_ep, struct elastic_subscriber *tx);
+void elastic_poll_events(struct elastic_poll *, short events);
+void elastic_poll_del(struct elastic_poll **);
 
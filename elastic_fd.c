@@ -31,6 +31,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -39,66 +40,241 @@
 #include "rc3600.h"
 #include "elastic.h"
 
+/*
+ * Output is collected in a small buffer, which is written when it is
+ * full or ELASTIC_FD_IDLE after the first byte went into it, so that
+ * a device doing one character at a time does not cost one write(2)
+ * per character.  Buffers are also flushed when the emulator exits.
+ * Before an output goes away, the device gets to flush what it holds
+ * back, and the output ELASTIC_FD_DRAIN to take what is queued for it.
+ */
+
+#define ELASTIC_FD_BUF		4096
+#define ELASTIC_FD_IDLE		10000000	// nsec
+#define ELASTIC_FD_DRAIN	1000000000	// nsec
+
 struct elastic_fd {
+	TAILQ_ENTRY(elastic_fd)		list;
 	struct elastic			*ep;
 	int				fd;
-	int				has_thread;
 	int				selfdestruct;
-	pthread_t			rxt;
+	struct elastic_poll		*epp;
 	struct elastic_subscriber	*ws;
+
+	pthread_mutex_t			mtx;
+	uint8_t				*obuf;
+	size_t				olen;
+	int				timer;
+	int				eof;
+	int				xonxoff;
 };
 
-static void *
-elastic_fd_rxthread(void *priv)
+static pthread_once_t elastic_fd_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t elastic_fd_mtx = PTHREAD_MUTEX_INITIALIZER;
+static TAILQ_HEAD(, elastic_fd) elastic_fds =
+    TAILQ_HEAD_INITIALIZER(elastic_fds);
+
+/*
+ * Write out the buffer, returns non-zero if it could not all go.
+ * Caller holds efp->mtx.
+ */
+
+static int
+elastic_fd_flush(struct elastic_fd *efp)
 {
-	struct elastic_fd *efp = priv;
-	char buf[1];
 	ssize_t sz;
 
-	while (1) {
-		sz = read(efp->fd, buf, 1);
-		if (sz != 1)
-			break;
-		elastic_inject(efp->ep, buf, 1);
+	if (efp->olen == 0)
+		return (0);
+	if (efp->eof) {
+		efp->olen = 0;
+		return (0);
 	}
-	if (efp->selfdestruct) {
+	sz = write(efp->fd, efp->obuf, efp->olen);
+	if (sz < 0 && (errno == EAGAIN || errno == EINTR))
+		return (1);
+	if (sz < 0 && errno == EPIPE)
+		efp->eof = 1;		// Like EOF, see elastic_fd_rx()
+	if (sz < 0)
+		sz = efp->olen;		// Nowhere to put it
+	efp->olen -= sz;
+	if (efp->olen > 0)
+		memmove(efp->obuf, efp->obuf + sz, efp->olen);
+	return (efp->olen > 0);
+}
+
+static void
+elastic_fd_atexit(void)
+{
+	struct elastic_fd *efp;
+	struct pollfd pfd[1];
+	int i;
+
+	AZ(pthread_mutex_lock(&elastic_fd_mtx));
+	TAILQ_FOREACH(efp, &elastic_fds, list) {
+		if (efp->ws != NULL && efp->ep->flush_func != NULL)
+			efp->ep->flush_func(efp->ep->flush_priv);
 		if (efp->ws != NULL)
-			elastic_unsubscribe(efp->ep, efp->ws);
-		AZ(close(efp->fd));
-		free(efp);
+			elastic_subscriber_drain(efp->ws, ELASTIC_FD_DRAIN);
+		AZ(pthread_mutex_lock(&efp->mtx));
+		for (i = 0; i < 10 && elastic_fd_flush(efp); i++) {
+			pfd->fd = efp->fd;
+			pfd->events = POLLOUT;
+			(void)poll(pfd, 1, 100);
+		}
+		AZ(pthread_mutex_unlock(&efp->mtx));
 	}
-	return (NULL);
+	AZ(pthread_mutex_unlock(&elastic_fd_mtx));
+}
+
+static void
+elastic_fd_init(void)
+{
+
+	AZ(atexit(elastic_fd_atexit));
 }
 
 static void
+elastic_fd_destroy(struct elastic_fd *efp)
+{
+
+	if (efp->epp != NULL)
+		elastic_poll_del(&efp->epp);
+	if (efp->ws != NULL) {
+		elastic_unsubscribe(efp->ep, efp->ws);
+		AZ(pthread_mutex_lock(&elastic_fd_mtx));
+		TAILQ_REMOVE(&elastic_fds, efp, list);
+		AZ(pthread_mutex_unlock(&elastic_fd_mtx));
+		(void)elastic_fd_flush(efp);
+		free(efp->obuf);
+	}
+	AZ(close(efp->fd));
+	AZ(pthread_mutex_destroy(&efp->mtx));
+	free(efp);
+}
+
+static void v_matchproto_(elastic_poll_f)
+elastic_fd_rx(struct elastic_poll *epp, short revents)
+{
+	struct elastic_fd *efp = epp->priv;
+	char buf[BUFSIZ];
+	ssize_t sz;
+	size_t len;
+
+	(void)revents;
+	if (!efp->eof) {
+		len = elastic_in_space(efp->ep);
+		if (len > sizeof buf)
+			len = sizeof buf;
+		if (len == 0)
+			return;
+		sz = read(efp->fd, buf, len);
+		if (sz > 0) {
+			elastic_inject(efp->ep, buf, sz);
+			return;
+		}
+		if (sz < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+	}
+	if (efp->selfdestruct)
+		elastic_fd_destroy(efp);
+	else
+		elastic_poll_events(epp, 0);
+}
+
+/*
+ * Text mode: strip parity, drop NUL, XON and XOFF.  Eight bytes at a
+ * time, falling back to bytewise only for words which have something
+ * to drop.  Returns number of bytes put in dst, which must have room
+ * for len bytes.
+ */
+
+#define ONES		0x0101010101010101ULL
+#define HIGHS		0x8080808080808080ULL
+#define HASZERO(w)	(((w) - ONES) & ~(w) & HIGHS)
+
+static size_t
+elastic_fd_text(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	uint8_t *d = dst, c;
+	uint64_t w;
+	size_t u;
+
+	for (; len >= 8; src += 8, len -= 8) {
+		memcpy(&w, src, 8);
+		w &= ~HIGHS;
+		if (!HASZERO(w) && !HASZERO(w ^ (ONES * 0x11)) &&
+		    !HASZERO(w ^ (ONES * 0x13))) {
+			memcpy(d, &w, 8);
+			d += 8;
+			continue;
+		}
+		for (u = 0; u < 8; u++) {
+			c = src[u] & 0x7f;
+			if (c != 0x00 && c != 0x11 && c != 0x13)
+				*d++ = c;
+		}
+	}
+	for (u = 0; u < len; u++) {
+		c = src[u] & 0x7f;
+		if (c != 0x00 && c != 0x11 && c != 0x13)
+			*d++ = c;
+	}
+	return (d - dst);
+}
+
+static ssize_t v_matchproto_(elastic_deliver_f)
 elastic_fd_txfunc(void *priv, const void *src, size_t len)
 {
 	struct elastic_fd *efp = priv;
-	const char *p = src;
-	char buf[1];
+	const uint8_t *p = src;
+	size_t u = 0, n;
 
-	if (!efp->ep->text) {
-		(void)write(efp->fd, src, len);
-		return;
+	AZ(pthread_mutex_lock(&efp->mtx));
+	if (len == 0) {
+		/* Idle timer */
+		efp->timer = 0;
+		if (elastic_fd_flush(efp)) {
+			efp->timer = 1;
+			elastic_subscriber_hold(efp->ws, now() + ELASTIC_FD_IDLE);
+		}
+		if (efp->eof && efp->selfdestruct && efp->epp != NULL)
+			elastic_poll_events(efp->epp, POLLIN);
+		AZ(pthread_mutex_unlock(&efp->mtx));
+		return (0);
 	}
-	while (len--) {
-		buf[0] = *p++ & 0x7f;
-		switch (buf[0]) {
-		case 0x00:
-		case 0x11:
-		case 0x13:
-			break;
-		default:
-			(void)write(efp->fd, buf, 1);
+	while (u < len) {
+		if (efp->olen >= ELASTIC_FD_BUF && elastic_fd_flush(efp))
 			break;
+		n = ELASTIC_FD_BUF - efp->olen;
+		if (n > len - u)
+			n = len - u;
+		if (efp->ep->text) {
+			efp->olen +=
+			    elastic_fd_text(efp->obuf + efp->olen, p + u, n);
+		} else {
+			memcpy(efp->obuf + efp->olen, p + u, n);
+			efp->olen += n;
 		}
+		u += n;
 	}
+	if (efp->olen >= ELASTIC_FD_BUF)
+		(void)elastic_fd_flush(efp);
+	if (efp->olen > 0 && !efp->timer) {
+		efp->timer = 1;
+		elastic_subscriber_hold(efp->ws, now() + ELASTIC_FD_IDLE);
+	}
+	if (efp->eof && efp->selfdestruct && efp->epp != NULL)
+		elastic_poll_events(efp->epp, POLLIN);	// Go away
+	AZ(pthread_mutex_unlock(&efp->mtx));
+	return (u);
 }
 
 struct elastic_fd *
-elastic_fd_start(struct elastic *ep, int fd, int mode, int selfdestruct)
+elastic_fd_start(struct elastic *ep, int fd, int mode, int flags)
 {
 	struct elastic_fd *efp;
+	int i;
 
 	AN(ep);
 	assert(fd > STDERR_FILENO);
@@ -108,19 +284,31 @@ elastic_fd_start(struct elastic *ep, int fd, int mode, int selfdestruct)
 	else
 		assert(ep->mode == O_RDWR || ep->mode == mode);
 
+	i = fcntl(fd, F_GETFL);
+	assert(i != -1);
+	AZ(fcntl(fd, F_SETFL, i | O_NONBLOCK));
+
 	efp = calloc(1, sizeof *efp);
 	AN(efp);
 	efp->fd = fd;
 	efp->ep = ep;
-	efp->selfdestruct = selfdestruct;
-	if (mode != O_RDONLY)
+	efp->selfdestruct = flags & ELASTIC_FD_SELFDESTRUCT;
+	AZ(pthread_mutex_init(&efp->mtx, NULL));
+	if (mode != O_RDONLY) {
+		AZ(pthread_once(&elastic_fd_once, elastic_fd_init));
+		efp->obuf = malloc(ELASTIC_FD_BUF + 1);	// + XON/XOFF
+		AN(efp->obuf);
 		efp->ws = elastic_subscribe(ep, elastic_fd_txfunc, efp);
-	if (mode != O_WRONLY) {
-		efp->has_thread = 1;
-		AZ(pthread_create(&efp->rxt, NULL, elastic_fd_rxthread, efp));
-		if (selfdestruct)
-			AZ(pthread_detach(efp->rxt));
+		AZ(pthread_mutex_lock(&elastic_fd_mtx));
+		efp->xonxoff = flags & ELASTIC_FD_XONXOFF;
+		TAILQ_INSERT_TAIL(&elastic_fds, efp, list);
+		AZ(pthread_mutex_unlock(&elastic_fd_mtx));
 	}
+	/* No POLLIN until efp->epp is set, EOF destroys efp right away */
+	efp->epp = elastic_poll_add(fd, 0, elastic_fd_rx, efp,
+	    mode != O_WRONLY ? ep : NULL, efp->ws);
+	if (mode != O_WRONLY)
+		elastic_poll_events(efp->epp, POLLIN);
 	return(efp);
 }
 
@@ -128,24 +316,50 @@ void
 elastic_fd_stop(struct elastic_fd **efpp)
 {
 	struct elastic_fd *efp;
-	void *p;
 
 	AN(efpp);
 	efp = *efpp;
 	*efpp = NULL;
 	AZ(efp->selfdestruct);
-	AZ(close(efp->fd));
 	if (efp->ws != NULL)
-		elastic_unsubscribe(efp->ep, efp->ws);
-	if (efp->has_thread)
-		AZ(pthread_join(efp->rxt, &p));
-	free(efp);
+		elastic_subscriber_drain(efp->ws, ELASTIC_FD_DRAIN);
+	elastic_fd_destroy(efp);
+}
+
+/*
+ * XOFF and XON for the input policy, to the endpoints started with
+ * ELASTIC_FD_XONXOFF.  They go out behind what is already queued for
+ * the endpoint, if the buffer is full, the latest one replaces the
+ * one waiting beyond its end.
+ */
+
+void
+elastic_fd_flow(const struct elastic *ep, int xoff)
+{
+	struct elastic_fd *efp;
+
+	AZ(pthread_mutex_lock(&elastic_fd_mtx));
+	TAILQ_FOREACH(efp, &elastic_fds, list) {
+		if (efp->ep != ep || !efp->xonxoff)
+			continue;
+		AZ(pthread_mutex_lock(&efp->mtx));
+		if (efp->olen > ELASTIC_FD_BUF)
+			efp->olen--;
+		efp->obuf[efp->olen++] = xoff ? 0x13 : 0x11;
+		if (elastic_fd_flush(efp) && !efp->timer) {
+			efp->timer = 1;
+			elastic_subscriber_hold(efp->ws,
+			    now() + ELASTIC_FD_IDLE);
+		}
+		AZ(pthread_mutex_unlock(&efp->mtx));
+	}
+	AZ(pthread_mutex_unlock(&elastic_fd_mtx));
 }
 
 static void
 elastic_serial(struct elastic *ep, struct cli *cli)
 {
-	int fd, i;
+	int fd;
 	struct termios tt;
 
 	if (cli->ac < 2) {
@@ -164,21 +378,6 @@ elastic_serial(struct elastic *ep, struct cli *cli)
 		return;
 	}
 
-	i = fcntl(fd, F_GETFL);
-	if (i == -1) {
-		cli_error(cli, "Cannot fcntl(F_GETFL) %s: %s\n",
-		    cli->av[1], strerror(errno));
-		(void)close(fd);
-		return;
-	}
-	i = fcntl(fd, F_SETFL, i & ~O_NONBLOCK);
-	if (i == -1) {
-		cli_error(cli, "Cannot fcntl(F_SETFL) %s: %s\n",
-		    cli->av[1], strerror(errno));
-		(void)close(fd);
-		return;
-	}
-
 	if (tcgetattr(fd, &tt)) {
 		cli_error(cli, "Not a tty %s: %s\n",
 		    cli->av[1], strerror(errno));
@@ -207,7 +406,8 @@ elastic_serial(struct elastic *ep, struct cli *cli)
 		break;
 	}
 	assert(tcsetattr(fd, TCSAFLUSH, &tt) == 0);
-	(void)elastic_fd_start(ep, fd, -1, 1);
+	(void)elastic_fd_start(ep, fd, -1,
+	    ELASTIC_FD_SELFDESTRUCT | ELASTIC_FD_XONXOFF);
 }
 
 int v_matchproto_(cli_elastic_f)
@@ -246,6 +446,8 @@ cli_elastic_fd(struct elastic *ep, struct cli *cli)
 			return (cli_error(cli, "Cannot open %s: %s\n",
 			    cli->av[1], strerror(errno)));
 
+		if (ep->out != NULL && ep->flush_func != NULL)
+			ep->flush_func(ep->flush_priv);
 		if (ep->out != NULL)
 			elastic_fd_stop(&ep->out);
 		ep->out = elastic_fd_start(ep, fd, O_WRONLY, 0);
@@ -265,7 +467,7 @@ cli_elastic_fd(struct elastic *ep, struct cli *cli)
 			return (cli_error(cli, "Cannot open %s: %s\n",
 			    cli->av[1], strerror(errno)));
 
-		(void)elastic_fd_start(ep, fd, O_RDONLY, 1);
+		(void)elastic_fd_start(ep, fd, O_RDONLY, ELASTIC_FD_SELFDESTRUCT);
 		cli->av += 2;
 		cli->ac -= 2;
 		return (1);
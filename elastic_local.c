@@ -0,0 +1,300 @@
+/*-
+ * Copyright (c) 2005-2020 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Local endpoints
+ * ---------------
+ *
+ * 'pty' allocates a pseudo-terminal and prints the name of its slave
+ * side, which terminal emulators, cu(1) or scripts can open, optionally
+ * through a symlink which is removed at exit.  We keep the slave open
+ * ourselves, so the master does not see EOF when clients come and go,
+ * and put it in raw mode.
+ *
+ * 'unix <path>' listens on an AF_UNIX socket, every connection is a raw
+ * endpoint like 'tcp', and the socket is removed again at exit.
+ * 'unix connect <path>' connects to one.
+ *
+ * Reads and writes go through elastic_fd, which batches both ways.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "rc3600.h"
+#include "elastic.h"
+
+struct unix_listen {
+	struct elastic			*ep;
+	int				fd;
+	struct elastic_poll		*epp;
+};
+
+/* Names we created, and remove at exit */
+struct local_path {
+	TAILQ_ENTRY(local_path)		list;
+	char				*path;
+};
+
+static pthread_once_t local_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t local_mtx = PTHREAD_MUTEX_INITIALIZER;
+static TAILQ_HEAD(, local_path) local_paths =
+    TAILQ_HEAD_INITIALIZER(local_paths);
+
+static void
+elastic_local_atexit(void)
+{
+	struct local_path *lp;
+
+	AZ(pthread_mutex_lock(&local_mtx));
+	TAILQ_FOREACH(lp, &local_paths, list)
+		(void)unlink(lp->path);
+	AZ(pthread_mutex_unlock(&local_mtx));
+}
+
+static void
+elastic_local_init(void)
+{
+
+	AZ(atexit(elastic_local_atexit));
+}
+
+static void
+elastic_local_remember(const char *path)
+{
+	struct local_path *lp;
+
+	lp = calloc(1, sizeof *lp);
+	AN(lp);
+	lp->path = strdup(path);
+	AN(lp->path);
+	AZ(pthread_once(&local_once, elastic_local_init));
+	AZ(pthread_mutex_lock(&local_mtx));
+	TAILQ_INSERT_TAIL(&local_paths, lp, list);
+	AZ(pthread_mutex_unlock(&local_mtx));
+}
+
+/* Pseudo-terminals ***************************************************/
+
+static int
+elastic_pty(struct elastic *ep, struct cli *cli, const char *link)
+{
+	int fd, sfd;
+	const char *name;
+	struct termios tt;
+	struct stat st;
+
+	/* Replace an old symlink, but nothing else */
+	if (link != NULL && !lstat(link, &st) && !S_ISLNK(st.st_mode))
+		return (cli_error(cli, "%s exists and is not a symlink\n",
+		    link));
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0)
+		return (cli_error(cli, "Cannot allocate pty: %s\n",
+		    strerror(errno)));
+	if (grantpt(fd) || unlockpt(fd) || (name = ptsname(fd)) == NULL) {
+		(void)cli_error(cli, "Cannot set up pty: %s\n",
+		    strerror(errno));
+		AZ(close(fd));
+		return (1);
+	}
+	sfd = open(name, O_RDWR | O_NOCTTY);
+	if (sfd < 0) {
+		(void)cli_error(cli, "Cannot open %s: %s\n",
+		    name, strerror(errno));
+		AZ(close(fd));
+		return (1);
+	}
+	AZ(tcgetattr(sfd, &tt));
+	cfmakeraw(&tt);
+	AZ(tcsetattr(sfd, TCSANOW, &tt));
+	/* sfd is deliberately never closed, see above */
+
+	if (link != NULL) {
+		if (!lstat(link, &st) && S_ISLNK(st.st_mode))
+			(void)unlink(link);
+		if (symlink(name, link)) {
+			(void)cli_error(cli, "Cannot symlink %s: %s\n",
+			    link, strerror(errno));
+			AZ(close(sfd));
+			AZ(close(fd));
+			return (1);
+		}
+		elastic_local_remember(link);
+	}
+	cli_printf(cli, "pty %s\n", name);
+	(void)elastic_fd_start(ep, fd, -1, ELASTIC_FD_XONXOFF);
+	return (0);
+}
+
+/* UNIX domain sockets ************************************************/
+
+static int
+elastic_unix_addr(struct cli *cli, struct sockaddr_un *sun, const char *path)
+{
+
+	memset(sun, 0, sizeof *sun);
+	sun->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof sun->sun_path)
+		return (cli_error(cli, "Path too long: %s\n", path));
+	strcpy(sun->sun_path, path);
+	return (0);
+}
+
+static void v_matchproto_(elastic_poll_f)
+elastic_unix_accept(struct elastic_poll *epp, short revents)
+{
+	struct unix_listen *ul = epp->priv;
+	int fd;
+
+	(void)revents;
+	fd = accept(ul->fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	(void)elastic_fd_start(ul->ep, fd, -1, ELASTIC_FD_SELFDESTRUCT);
+}
+
+static int
+elastic_unix_listen(struct elastic *ep, struct cli *cli, const char *path)
+{
+	struct sockaddr_un sun;
+	struct unix_listen *ul;
+	struct stat st;
+	int s, i;
+
+	if (elastic_unix_addr(cli, &sun, path))
+		return (1);
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert(s >= 0);
+	/* Remove stale sockets, but nothing else and nobody else's */
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode)) {
+		if (!connect(s, (void*)&sun, sizeof sun))
+			errno = EADDRINUSE;
+		if (errno != ECONNREFUSED) {
+			(void)cli_error(cli, "Cannot listen on %s: %s\n",
+			    path, strerror(errno));
+			AZ(close(s));
+			return (1);
+		}
+		(void)unlink(path);
+		AZ(close(s));
+		s = socket(AF_UNIX, SOCK_STREAM, 0);
+		assert(s >= 0);
+	}
+	if (bind(s, (void*)&sun, sizeof sun) || listen(s, 8)) {
+		(void)cli_error(cli, "Cannot listen on %s: %s\n",
+		    path, strerror(errno));
+		AZ(close(s));
+		return (1);
+	}
+	i = fcntl(s, F_GETFL);
+	assert(i != -1);
+	AZ(fcntl(s, F_SETFL, i | O_NONBLOCK));
+
+	ul = calloc(1, sizeof *ul);
+	AN(ul);
+	ul->ep = ep;
+	ul->fd = s;
+	elastic_local_remember(path);
+	ul->epp = elastic_poll_add(s, POLLIN, elastic_unix_accept, ul,
+	    NULL, NULL);
+	return (0);
+}
+
+static int
+elastic_unix_connect(struct elastic *ep, struct cli *cli, const char *path)
+{
+	struct sockaddr_un sun;
+	int s;
+
+	if (elastic_unix_addr(cli, &sun, path))
+		return (1);
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert(s >= 0);
+	if (connect(s, (void*)&sun, sizeof sun)) {
+		(void)cli_error(cli, "Cannot connect to %s: %s\n",
+		    path, strerror(errno));
+		AZ(close(s));
+		return (1);
+	}
+	(void)elastic_fd_start(ep, s, -1, ELASTIC_FD_SELFDESTRUCT);
+	return (0);
+}
+
+int v_matchproto_(cli_elastic_f)
+cli_elastic_local(struct elastic *ep, struct cli *cli)
+{
+
+	AN(cli);
+	if (cli->help) {
+		cli_printf(cli, "\tpty [<symlink>]\n");
+		cli_printf(cli, "\t\tAllocate pseudo-terminal, print its name\n");
+		cli_printf(cli, "\tunix [connect] <path>\n");
+		cli_printf(cli, "\t\tListen or connect on UNIX domain socket\n");
+		return (0);
+	}
+	AN(ep);
+
+	if (!strcmp(*cli->av, "pty")) {
+		if (cli->ac > 2) {
+			(void)cli_n_args(cli, 1);
+			return (1);
+		}
+		(void)elastic_pty(ep, cli, cli->ac > 1 ? cli->av[1] : NULL);
+		cli->av += cli->ac;
+		cli->ac = 0;
+		return (1);
+	}
+	if (!strcmp(*cli->av, "unix")) {
+		if (cli->ac == 3 && !strcmp(cli->av[1], "connect")) {
+			(void)elastic_unix_connect(ep, cli, cli->av[2]);
+			cli->av += 3;
+			cli->ac -= 3;
+			return (1);
+		}
+		if (cli_n_args(cli, 1))
+			return (1);
+		(void)elastic_unix_listen(ep, cli, cli->av[1]);
+		cli->av += 2;
+		cli->ac -= 2;
+		return (1);
+	}
+	return (0);
+}
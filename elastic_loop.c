@@ -0,0 +1,400 @@
+/*-
+ * Copyright (c) 2005-2020 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * One thread services all file descriptors and output subscribers of
+ * all elastic buffers.
+ *
+ * Everything the loop calls out to must be non-blocking.  Deliver
+ * functions which cannot take all of the data return how much they
+ * took, and the subscriber is stalled until its file descriptor becomes
+ * writable or until somebody calls elastic_subscriber_resume().
+ * Subscribers can also be held until a point in time, for instance to
+ * batch output to sockets.
+ *
+ * Pollers and subscribers can be removed from any thread, if it is not
+ * the loop thread itself, removal waits until the loop is not inside a
+ * callback for that poller or subscriber.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rc3600.h"
+#include "elastic.h"
+
+static pthread_once_t		eloop_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t		eloop_mtx;
+static pthread_cond_t		eloop_cond;
+static pthread_t		eloop_thread;
+static int			eloop_pipe[2];
+static int			eloop_kicked;
+static const void		*eloop_busy;
+static TAILQ_HEAD(, elastic_poll) eloop_polls =
+    TAILQ_HEAD_INITIALIZER(eloop_polls);
+static TAILQ_HEAD(, elastic_subscriber) eloop_ready =
+    TAILQ_HEAD_INITIALIZER(eloop_ready);
+static TAILQ_HEAD(, elastic_subscriber) eloop_held =
+    TAILQ_HEAD_INITIALIZER(eloop_held);
+
+static void
+eloop_set_busy(const void *what)
+{
+
+	AZ(pthread_mutex_lock(&eloop_mtx));
+	eloop_busy = what;
+	if (what == NULL)
+		AZ(pthread_cond_broadcast(&eloop_cond));
+	AZ(pthread_mutex_unlock(&eloop_mtx));
+}
+
+static short
+eloop_events(const struct elastic_poll *epp)
+{
+	short ev;
+
+	ev = epp->events;
+	if (epp->rx_ep != NULL && (ev & POLLIN) && elastic_in_full(epp->rx_ep))
+		ev &= ~POLLIN;
+	if (epp->tx != NULL && epp->tx->stalled && !epp->tx->held)
+		ev |= POLLOUT;
+	return (ev);
+}
+
+/*
+ * Milliseconds until the first held subscriber is due, -1 if none.
+ * Caller holds eloop_mtx.
+ */
+
+static int
+eloop_timeout(void)
+{
+	struct elastic_subscriber *esp;
+	nanosec t, d, dmin = -1;
+
+	if (TAILQ_EMPTY(&eloop_held))
+		return (-1);
+	t = now();
+	TAILQ_FOREACH(esp, &eloop_held, held_list) {
+		d = esp->hold - t;
+		if (d < 0)
+			d = 0;
+		if (dmin < 0 || d < dmin)
+			dmin = d;
+	}
+	return ((int)((dmin + 999999) / 1000000));
+}
+
+static void
+eloop_release_held(void)
+{
+	struct elastic_subscriber *esp;
+	nanosec t;
+
+	t = now();
+	AZ(pthread_mutex_lock(&eloop_mtx));
+	while (1) {
+		TAILQ_FOREACH(esp, &eloop_held, held_list)
+			if (esp->hold <= t)
+				break;
+		if (esp == NULL)
+			break;
+		TAILQ_REMOVE(&eloop_held, esp, held_list);
+		esp->held = 0;
+		esp->expired = 1;
+		eloop_busy = esp;
+		AZ(pthread_mutex_unlock(&eloop_mtx));
+		elastic_subscriber_resume(esp);
+		AZ(pthread_mutex_lock(&eloop_mtx));
+		eloop_busy = NULL;
+		AZ(pthread_cond_broadcast(&eloop_cond));
+	}
+	AZ(pthread_mutex_unlock(&eloop_mtx));
+}
+
+static void *
+eloop_main(void *priv)
+{
+	struct pollfd *pfd = NULL;
+	struct elastic_poll **pep = NULL, *epp, *epp2;
+	struct elastic_subscriber *esp;
+	unsigned npfd = 0, n, u;
+	int tmo;
+	char buf[64];
+
+	(void)priv;
+	while (1) {
+		AZ(pthread_mutex_lock(&eloop_mtx));
+		n = 1;
+		TAILQ_FOREACH_SAFE(epp, &eloop_polls, list, epp2) {
+			if (epp->dead) {
+				TAILQ_REMOVE(&eloop_polls, epp, list);
+				free(epp);
+			} else {
+				n++;
+			}
+		}
+		if (n > npfd) {
+			npfd = n + 16;
+			pfd = realloc(pfd, npfd * sizeof *pfd);
+			AN(pfd);
+			pep = realloc(pep, npfd * sizeof *pep);
+			AN(pep);
+		}
+		pfd[0].fd = eloop_pipe[0];
+		pfd[0].events = POLLIN;
+		n = 1;
+		TAILQ_FOREACH(epp, &eloop_polls, list) {
+			pep[n] = epp;
+			pfd[n].fd = epp->fd;
+			pfd[n].events = eloop_events(epp);
+			pfd[n].revents = 0;
+			if (pfd[n].events == 0)
+				pfd[n].fd = -1;
+			n++;
+		}
+		tmo = eloop_timeout();
+		AZ(pthread_mutex_unlock(&eloop_mtx));
+
+		if (poll(pfd, n, tmo) < 0) {
+			assert(errno == EINTR);
+			continue;
+		}
+
+		if (pfd[0].revents) {
+			AZ(pthread_mutex_lock(&eloop_mtx));
+			(void)read(eloop_pipe[0], buf, sizeof buf);
+			eloop_kicked = 0;
+			AZ(pthread_mutex_unlock(&eloop_mtx));
+		}
+
+		for (u = 1; u < n; u++) {
+			if (!pfd[u].revents)
+				continue;
+			epp = pep[u];
+			AZ(pthread_mutex_lock(&eloop_mtx));
+			if (epp->dead) {
+				AZ(pthread_mutex_unlock(&eloop_mtx));
+				continue;
+			}
+			eloop_busy = epp;
+			AZ(pthread_mutex_unlock(&eloop_mtx));
+			if (epp->tx != NULL && (pfd[u].revents & POLLOUT))
+				elastic_subscriber_resume(epp->tx);
+			if (epp->func != NULL &&
+			    (pfd[u].revents & ~POLLOUT || epp->tx == NULL))
+				epp->func(epp, pfd[u].revents);
+			eloop_set_busy(NULL);
+		}
+
+		eloop_release_held();
+
+		AZ(pthread_mutex_lock(&eloop_mtx));
+		while (!TAILQ_EMPTY(&eloop_ready)) {
+			esp = TAILQ_FIRST(&eloop_ready);
+			TAILQ_REMOVE(&eloop_ready, esp, ready_list);
+			esp->queued = 0;
+			eloop_busy = esp;
+			AZ(pthread_mutex_unlock(&eloop_mtx));
+			elastic_deliver(esp);
+			AZ(pthread_mutex_lock(&eloop_mtx));
+			eloop_busy = NULL;
+			AZ(pthread_cond_broadcast(&eloop_cond));
+		}
+		AZ(pthread_mutex_unlock(&eloop_mtx));
+	}
+	return (NULL);
+}
+
+static void
+eloop_init(void)
+{
+	int i;
+
+	AZ(pthread_mutex_init(&eloop_mtx, NULL));
+	AZ(pthread_cond_init(&eloop_cond, NULL));
+	AZ(pipe(eloop_pipe));
+	for (i = 0; i < 2; i++) {
+		AZ(fcntl(eloop_pipe[i], F_SETFL, O_NONBLOCK));
+		AZ(fcntl(eloop_pipe[i], F_SETFD, FD_CLOEXEC));
+	}
+	AZ(pthread_create(&eloop_thread, NULL, eloop_main, NULL));
+}
+
+static void
+eloop_kick_locked(void)
+{
+
+	if (!eloop_kicked && !pthread_equal(pthread_self(), eloop_thread)) {
+		eloop_kicked = 1;
+		(void)write(eloop_pipe[1], "", 1);
+	}
+}
+
+void
+elastic_loop_kick(void)
+{
+
+	AZ(pthread_once(&eloop_once, eloop_init));
+	AZ(pthread_mutex_lock(&eloop_mtx));
+	eloop_kick_locked();
+	AZ(pthread_mutex_unlock(&eloop_mtx));
+}
+
+int
+elastic_loop_self(void)
+{
+
+	AZ(pthread_once(&eloop_once, eloop_init));
+	return (pthread_equal(pthread_self(), eloop_thread));
+}
+
+/*
+ * Wait until the loop is not busy with 'what'.  Caller holds eloop_mtx.
+ */
+
+static void
+eloop_wait_idle(const void *what)
+{
+
+	if (pthread_equal(pthread_self(), eloop_thread))
+		return;
+	while (eloop_busy == what)
+		AZ(pthread_cond_wait(&eloop_cond, &eloop_mtx));
+}
+
+/* Subscribers ********************************************************/
+
+void
+elastic_loop_ready(struct elastic_subscriber *esp)
+{
+
+	AZ(pthread_once(&eloop_once, eloop_init));
+	AZ(pthread_mutex_lock(&eloop_mtx));
+	if (!esp->queued && !esp->dead) {
+		esp->queued = 1;
+		TAILQ_INSERT_TAIL(&eloop_ready, esp, ready_list);
+		eloop_kick_locked();
+	}
+	AZ(pthread_mutex_unlock(&eloop_mtx));
+}
+
+void
+elastic_loop_forget(struct elastic_subscriber *esp)
+{
+
+	AZ(pthread_once(&eloop_once, eloop_init));
+	AZ(pthread_mutex_lock(&eloop_mtx));
+	esp->dead = 1;
+	if (esp->queued) {
+		TAILQ_REMOVE(&eloop_ready, esp, ready_list);
+		esp->queued = 0;
+	}
+	if (esp->held) {
+		TAILQ_REMOVE(&eloop_held, esp, held_list);
+		esp->held = 0;
+	}
+	eloop_wait_idle(esp);
+	AZ(pthread_mutex_unlock(&eloop_mtx));
+}
+
+/*
+ * Resume the subscriber at (now() based) time 'when', it does not get
+ * POLLOUT service in the meantime.
+ */
+
+void
+elastic_subscriber_hold(struct elastic_subscriber *esp, nanosec when)
+{
+
+	AZ(pthread_once(&eloop_once, eloop_init));
+	AZ(pthread_mutex_lock(&eloop_mtx));
+	if (!esp->dead) {
+		esp->hold = when;
+		if (!esp->held) {
+			esp->held = 1;
+			TAILQ_INSERT_TAIL(&eloop_held, esp, held_list);
+		}
+		eloop_kick_locked();
+	}
+	AZ(pthread_mutex_unlock(&eloop_mtx));
+}
+
+/* File descriptors ***************************************************/
+
+struct elastic_poll *
+elastic_poll_add(int fd, short events, elastic_poll_f *func, void *priv,
+    struct elastic *rx_ep, struct elastic_subscriber *tx)
+{
+	struct elastic_poll *epp;
+
+	AZ(pthread_once(&eloop_once, eloop_init));
+	epp = calloc(1, sizeof *epp);
+	AN(epp);
+	epp->fd = fd;
+	epp->events = events;
+	epp->func = func;
+	epp->priv = priv;
+	epp->rx_ep = rx_ep;
+	epp->tx = tx;
+	AZ(pthread_mutex_lock(&eloop_mtx));
+	TAILQ_INSERT_TAIL(&eloop_polls, epp, list);
+	eloop_kick_locked();
+	AZ(pthread_mutex_unlock(&eloop_mtx));
+	return (epp);
+}
+
+void
+elastic_poll_events(struct elastic_poll *epp, short events)
+{
+
+	AZ(pthread_mutex_lock(&eloop_mtx));
+	epp->events = events;
+	eloop_kick_locked();
+	AZ(pthread_mutex_unlock(&eloop_mtx));
+}
+
+void
+elastic_poll_del(struct elastic_poll **eppp)
+{
+	struct elastic_poll *epp;
+
+	AN(eppp);
+	epp = *eppp;
+	*eppp = NULL;
+	AN(epp);
+	AZ(pthread_mutex_lock(&eloop_mtx));
+	epp->dead = 1;
+	eloop_wait_idle(epp);
+	eloop_kick_locked();
+	AZ(pthread_mutex_unlock(&eloop_mtx));
+}
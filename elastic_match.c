@@ -29,45 +29,180 @@
  *
  */
 
+/*
+ * Output matching for scripts
+ * ---------------------------
+ *
+ * Several patterns can be armed at the same time, some of them can be
+ * marked as failures.  The patterns are compiled into an Aho-Corasick
+ * automaton, so a single pass over the output finds the first match of
+ * any of them, overlapping or not.  While the automaton sits in its
+ * root state memchr(3) skips ahead to the next possible first byte.
+ *
+ * Waits can be limited in wall-clock time and/or simulated time.
+ */
+
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "rc3600.h"
 #include "elastic.h"
 
+#define EM_MAXPAT	8
+
+struct em_pat {
+	uint8_t				*str;
+	size_t				len;
+	int				fail;
+};
+
 struct elastic_match {
 	struct elastic			*ep;
-	char				*pattern;
-	int				idx;
-	int				match;
 	struct elastic_subscriber	*ws;
 	pthread_mutex_t			mtx;
 	pthread_cond_t			cond;
+
+	struct em_pat			pat[EM_MAXPAT];
+	unsigned			npat;
+
+	/* Automaton */
+	unsigned			*delta;		// [nnode][256]
+	int				*out;		// [nnode]
+	unsigned			nnode;
+	unsigned			state;
+	int				nfirst;
+	uint8_t				first;
+
+	int				match;
+	int				which;
+
+	nanosec				wall_timeout;
+	nanosec				sim_timeout;
+	nanosec				sim_deadline;
+	int				sim_expired;
 };
 
-static void
+static ssize_t v_matchproto_(elastic_deliver_f)
 elastic_match_txfunc(void *priv, const void *src, size_t len)
 {
 	struct elastic_match *em = priv;
-	const char *s = src;
+	const uint8_t *s = src, *p;
+	const unsigned *d;
+	size_t u;
 
 	AZ(pthread_mutex_lock(&em->mtx));
-	while (em->match || em->pattern == NULL)
-		AZ(pthread_cond_wait(&em->cond, &em->mtx));
-	for (; len > 0; s++, len--) {
-		if (em->pattern[em->idx] != *s) {
-			em->idx = 0;
-			continue;
+	if (em->match || em->npat == 0) {
+		/* Hold on to the output until we are armed */
+		AZ(pthread_mutex_unlock(&em->mtx));
+		return (0);
+	}
+	d = em->delta;
+	for (u = 0; u < len; ) {
+		if (em->state == 0) {
+			if (em->nfirst == 1) {
+				p = memchr(s + u, em->first, len - u);
+				if (p == NULL) {
+					u = len;
+					break;
+				}
+				u = p - s;
+			} else {
+				while (u < len && d[s[u]] == 0)
+					u++;
+				if (u == len)
+					break;
+			}
+		}
+		em->state = d[em->state * 256 + s[u++]];
+		if (em->out[em->state] >= 0) {
+			em->match = 1;
+			em->which = em->out[em->state];
+			AZ(pthread_cond_broadcast(&em->cond));
+			break;
 		}
-		if (em->pattern[++em->idx] != '\0')
-			continue;
-		em->match = 1;
-		AZ(pthread_cond_signal(&em->cond));
-		printf("✓\n");
 	}
 	AZ(pthread_mutex_unlock(&em->mtx));
+	return (u);
+}
+
+/*
+ * Build the automaton as a full transition table, which for the few
+ * short patterns scripts use is small, and makes the scan a single
+ * table lookup per byte.
+ */
+
+static void
+elastic_match_compile(struct elastic_match *em)
+{
+	unsigned n, u, c, r, st, *fail, *queue, qh = 0, qt = 0;
+	const struct em_pat *pp;
+
+	n = 1;
+	for (u = 0; u < em->npat; u++)
+		n += em->pat[u].len;
+	free(em->delta);
+	free(em->out);
+	em->delta = calloc(n * 256L, sizeof *em->delta);
+	AN(em->delta);
+	em->out = malloc(n * sizeof *em->out);
+	AN(em->out);
+	fail = calloc(n, sizeof *fail);
+	AN(fail);
+	queue = calloc(n, sizeof *queue);
+	AN(queue);
+	for (u = 0; u < n; u++)
+		em->out[u] = -1;
+
+	/* Trie */
+	em->nnode = 1;
+	for (u = 0; u < em->npat; u++) {
+		pp = &em->pat[u];
+		st = 0;
+		for (c = 0; c < pp->len; c++) {
+			r = st * 256 + pp->str[c];
+			if (em->delta[r] == 0)
+				em->delta[r] = em->nnode++;
+			st = em->delta[r];
+		}
+		if (em->out[st] < 0)
+			em->out[st] = u;
+	}
+
+	/* Failure transitions, breadth first */
+	for (c = 0; c < 256; c++) {
+		st = em->delta[c];
+		if (st != 0)
+			queue[qt++] = st;
+	}
+	while (qh < qt) {
+		r = queue[qh++];
+		if (em->out[r] < 0)
+			em->out[r] = em->out[fail[r]];
+		for (c = 0; c < 256; c++) {
+			st = em->delta[r * 256 + c];
+			if (st != 0) {
+				fail[st] = em->delta[fail[r] * 256 + c];
+				queue[qt++] = st;
+			} else {
+				em->delta[r * 256 + c] =
+				    em->delta[fail[r] * 256 + c];
+			}
+		}
+	}
+	free(fail);
+	free(queue);
+
+	em->nfirst = 0;
+	for (c = 0; c < 256; c++) {
+		if (em->delta[c] != 0) {
+			em->first = c;
+			em->nfirst++;
+		}
+	}
+	em->state = 0;
 }
 
 static void
@@ -80,66 +215,210 @@ elastic_match_new(struct elastic *ep)
 	em->ep = ep;
 	AZ(pthread_mutex_init(&em->mtx, NULL));
 	AZ(pthread_cond_init(&em->cond, NULL));
-	em->pattern = NULL;
-	em->idx = 0;
 	em->ws = elastic_subscribe(ep, elastic_match_txfunc, em);
 	ep->em = em;
 }
 
 static void
-elastic_match_arm(const struct elastic *ep, const char *match)
+elastic_match_clear(struct elastic_match *em)
 {
-	struct elastic_match *em;
 
-	em = ep->em;
-	AN(em);
+	while (em->npat > 0)
+		free(em->pat[--em->npat].str);
+}
+
+static int
+elastic_match_add(struct cli *cli, struct elastic_match *em,
+    const void *ptr, size_t len, int fail)
+{
+	struct em_pat *pp;
 
+	if (em->npat == EM_MAXPAT)
+		return (cli_error(cli, "Too many match patterns\n"));
+	if (len == 0)
+		return (cli_error(cli, "Empty match pattern\n"));
+	pp = &em->pat[em->npat++];
+	pp->str = malloc(len);
+	AN(pp->str);
+	memcpy(pp->str, ptr, len);
+	pp->len = len;
+	pp->fail = fail;
+	return (0);
+}
+
+static void
+elastic_match_arm(struct elastic_match *em)
+{
+
+	AN(em);
 	AZ(pthread_mutex_lock(&em->mtx));
-	if (em->pattern != NULL)
-		free(em->pattern);
-	em->pattern = strdup(match);
-	AN(em->pattern);
-	em->idx = 0;
+	elastic_match_compile(em);
 	em->match = 0;
-	AZ(pthread_cond_signal(&em->cond));
+	em->which = -1;
 	AZ(pthread_mutex_unlock(&em->mtx));
+	elastic_subscriber_resume(em->ws);
 }
 
+/*
+ * Single pattern shortcuts
+ */
+
 static void
-elastic_match_wait(const struct elastic *ep)
+elastic_match_arm1(struct cli *cli, struct elastic_match *em,
+    const void *ptr, size_t len)
 {
-	struct elastic_match *em;
 
-	em = ep->em;
+	AZ(pthread_mutex_lock(&em->mtx));
+	elastic_match_clear(em);
+	(void)elastic_match_add(cli, em, ptr, len, 0);
+	AZ(pthread_mutex_unlock(&em->mtx));
+	if (!cli->status)
+		elastic_match_arm(em);
+}
+
+/*
+ * Parse: <string> [or <string>]... [fail <string>]...
+ */
+
+static void
+elastic_match_arm_cli(struct cli *cli, struct elastic_match *em)
+{
+	int fail;
+
+	AZ(pthread_mutex_lock(&em->mtx));
+	elastic_match_clear(em);
+	(void)elastic_match_add(cli, em, cli->av[1], strlen(cli->av[1]), 0);
+	cli->av += 2;
+	cli->ac -= 2;
+	while (!cli->status && cli->ac >= 2) {
+		if (!strcasecmp(*cli->av, "or"))
+			fail = 0;
+		else if (!strcasecmp(*cli->av, "fail"))
+			fail = 1;
+		else
+			break;
+		(void)elastic_match_add(cli, em,
+		    cli->av[1], strlen(cli->av[1]), fail);
+		cli->av += 2;
+		cli->ac -= 2;
+	}
+	AZ(pthread_mutex_unlock(&em->mtx));
+	if (!cli->status)
+		elastic_match_arm(em);
+}
+
+static void v_matchproto_(callout_cb_f)
+elastic_match_sim_expire(void *priv, nanosec when)
+{
+	struct elastic_match *em = priv;
+
+	AZ(pthread_mutex_lock(&em->mtx));
+	if (em->sim_deadline != 0 && when >= em->sim_deadline) {
+		em->sim_expired = 1;
+		AZ(pthread_cond_broadcast(&em->cond));
+	}
+	AZ(pthread_mutex_unlock(&em->mtx));
+}
+
+static int
+elastic_match_wait(struct cli *cli, struct elastic_match *em)
+{
+	struct timespec ts;
+	nanosec t;
+	int err = 0;
+	const struct em_pat *pp;
+
 	AN(em);
+	if (em->npat == 0)
+		return (cli_error(cli, "Nothing armed\n"));
+	t = 0;
+	if (em->sim_timeout > 0) {
+		AZ(pthread_mutex_lock(&em->ep->cs->run_mtx));
+		t = em->ep->cs->sim_time + em->sim_timeout;
+		AZ(pthread_mutex_unlock(&em->ep->cs->run_mtx));
+	}
+	AZ(pthread_mutex_lock(&em->mtx));
+	em->sim_expired = 0;
+	em->sim_deadline = t;
+	AZ(pthread_mutex_unlock(&em->mtx));
+	if (t != 0) {
+		/* Fires no earlier than the deadline we just recorded */
+		callout_callback(em->ep->cs, em->sim_timeout,
+		    elastic_match_sim_expire, em);
+	}
 	AZ(pthread_mutex_lock(&em->mtx));
-	while (!em->match)
-		AZ(pthread_cond_wait(&em->cond, &em->mtx));
+	if (em->wall_timeout > 0) {
+		AZ(clock_gettime(CLOCK_REALTIME, &ts));
+		t = ts.tv_nsec + em->wall_timeout;
+		ts.tv_sec += t / 1000000000;
+		ts.tv_nsec = t % 1000000000;
+	}
+	while (!em->match && !em->sim_expired && err != ETIMEDOUT) {
+		if (em->wall_timeout > 0)
+			err = pthread_cond_timedwait(&em->cond, &em->mtx, &ts);
+		else
+			err = pthread_cond_wait(&em->cond, &em->mtx);
+		assert(err == 0 || err == ETIMEDOUT);
+	}
+	em->sim_deadline = 0;
+	if (!em->match) {
+		AZ(pthread_mutex_unlock(&em->mtx));
+		return (cli_error(cli, "Match timeout (%s time)\n",
+		    em->sim_expired ? "simulated" : "wall-clock"));
+	}
+	assert(em->which >= 0 && em->which < (int)em->npat);
+	pp = &em->pat[em->which];
 	AZ(pthread_mutex_unlock(&em->mtx));
+	if (pp->fail)
+		return (cli_error(cli, "Match failed on \"%.*s\"\n",
+		    (int)pp->len, pp->str));
+	if (em->npat > 1)
+		printf("✓ \"%.*s\"\n", (int)pp->len, pp->str);
+	else
+		printf("✓\n");
 
 	/*
 	 * This sleep delays long enough that the DOMUS TTY driver will
 	 * be ready for a "tty << something" command.
 	 */
 	usleep(150000);
+	return (0);
+}
+
+static nanosec
+elastic_match_seconds(const char *s)
+{
+
+	return ((nanosec)(strtod(s, NULL) * 1e9));
 }
 
 int v_matchproto_(cli_elastic_f)
 cli_elastic_match(struct elastic *ep, struct cli *cli)
 {
-	char buf[2];
+	struct elastic_match *em;
+	char buf[1];
 
 	AN(cli);
 	if (cli->help) {
-		cli_printf(cli, "\tmatch arm <string>\n");
-		cli_printf(cli, "\t\tStart looking for string\n");
+		cli_printf(cli, "\tmatch arm <string> [or <string>]... "
+		    "[fail <string>]...\n");
+		cli_printf(cli, "\t\tStart looking for strings\n");
 		cli_printf(cli, "\tmatch wait\n");
-		cli_printf(cli, "\t\tWait for 'arm' to match\n");
-		cli_printf(cli, "\tmatch expect <string>\n");
+		cli_printf(cli, "\t\tWait for 'arm' to match, error if a "
+		    "'fail' string matched\n");
+		cli_printf(cli, "\tmatch expect <string> [or <string>]... "
+		    "[fail <string>]...\n");
 		cli_printf(cli, "\t\tShortcut for 'arm' + 'wait'\n");
 		cli_printf(cli, "\tmatch xon\n");
-		cli_printf(cli, "\tmatch nl\n");
 		cli_printf(cli, "\t\tWait for XON character\n");
+		cli_printf(cli, "\tmatch nl\n");
+		cli_printf(cli, "\t\tWait for newline character\n");
+		cli_printf(cli, "\tmatch byte <number>\n");
+		cli_printf(cli, "\t\tWait for byte value\n");
+		cli_printf(cli, "\tmatch timeout <seconds>\n");
+		cli_printf(cli, "\t\tFail waits after wall-clock time (0=never)\n");
+		cli_printf(cli, "\tmatch simtimeout <seconds>\n");
+		cli_printf(cli, "\t\tFail waits after simulated time (0=never)\n");
 		return (0);
 	}
 	AN(ep);
@@ -150,13 +429,14 @@ cli_elastic_match(struct elastic *ep, struct cli *cli)
 	cli->ac--;
 	if (ep->em == NULL)
 		elastic_match_new(ep);
+	em = ep->em;
 
 	if (!strcasecmp(*cli->av, "arm")) {
-		if (cli_n_args(cli, 1))
-			return(1);
-		elastic_match_arm(ep, cli->av[1]);
-		cli->av += 2;
-		cli->ac -= 2;
+		if (cli->ac < 2) {
+			(void)cli_n_args(cli, 1);
+			return (1);
+		}
+		elastic_match_arm_cli(cli, em);
 		return (1);
 	}
 	if (!strcasecmp(*cli->av, "wait")) {
@@ -164,23 +444,24 @@ cli_elastic_match(struct elastic *ep, struct cli *cli)
 			return(1);
 		cli->av += 1;
 		cli->ac -= 1;
-		elastic_match_wait(ep);
+		(void)elastic_match_wait(cli, em);
 		return (1);
 	}
 	if (!strcasecmp(*cli->av, "expect")) {
-		if (cli_n_args(cli, 1))
-			return(1);
-		elastic_match_arm(ep, cli->av[1]);
-		elastic_match_wait(ep);
-		cli->av += 2;
-		cli->ac -= 2;
+		if (cli->ac < 2) {
+			(void)cli_n_args(cli, 1);
+			return (1);
+		}
+		elastic_match_arm_cli(cli, em);
+		if (!cli->status)
+			(void)elastic_match_wait(cli, em);
 		return (1);
 	}
 	if (!strcasecmp(*cli->av, "xon")) {
 		if (cli_n_args(cli, 0))
 			return(1);
-		elastic_match_arm(ep, "\x11");
-		elastic_match_wait(ep);
+		elastic_match_arm1(cli, em, "\x11", 1);
+		(void)elastic_match_wait(cli, em);
 		cli->av += 1;
 		cli->ac -= 1;
 		return (1);
@@ -188,8 +469,8 @@ cli_elastic_match(struct elastic *ep, struct cli *cli)
 	if (!strcasecmp(*cli->av, "nl")) {
 		if (cli_n_args(cli, 0))
 			return(1);
-		elastic_match_arm(ep, "\n");
-		elastic_match_wait(ep);
+		elastic_match_arm1(cli, em, "\n", 1);
+		(void)elastic_match_wait(cli, em);
 		cli->av += 1;
 		cli->ac -= 1;
 		return (1);
@@ -198,9 +479,24 @@ cli_elastic_match(struct elastic *ep, struct cli *cli)
 		if (cli_n_args(cli, 1))
 			return(1);
 		buf[0] = strtoul(cli->av[1], NULL, 0);
-		buf[1] = 0x00;
-		elastic_match_arm(ep, buf);
-		elastic_match_wait(ep);
+		elastic_match_arm1(cli, em, buf, 1);
+		(void)elastic_match_wait(cli, em);
+		cli->av += 2;
+		cli->ac -= 2;
+		return (1);
+	}
+	if (!strcasecmp(*cli->av, "timeout")) {
+		if (cli_n_args(cli, 1))
+			return(1);
+		em->wall_timeout = elastic_match_seconds(cli->av[1]);
+		cli->av += 2;
+		cli->ac -= 2;
+		return (1);
+	}
+	if (!strcasecmp(*cli->av, "simtimeout")) {
+		if (cli_n_args(cli, 1))
+			return(1);
+		em->sim_timeout = elastic_match_seconds(cli->av[1]);
 		cli->av += 2;
 		cli->ac -= 2;
 		return (1);
@@ -29,6 +29,25 @@
  *
  */
 
+/*
+ * TELNET server
+ * -------------
+ *
+ * Each 'telnet' command creates a server which can have any number of
+ * connections.  The first connection to arrive controls the elastic
+ * buffer, subsequent connections are observers which see the output
+ * but whose input is thrown away.  When the controlling connection
+ * goes away, the oldest observer takes over.  With 'observe' all
+ * connections are observers.
+ *
+ * Output to each connection is batched, so that at most one write(2)
+ * goes out per "tick" of sixteen character times at the elastic's
+ * baud-rate.  The first write after a pause goes out immediately so
+ * echo is snappy.
+ *
+ * Everything here runs on the elastic loop thread.
+ */
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -37,92 +56,394 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <poll.h>
 
 #include "rc3600.h"
 #include "elastic.h"
 
-struct acceptor_arg {
+#define TELNET_MAX_CONN		16
+#define TELNET_BATCH		16		// characters per tick
+#define TELNET_TICK_MIN		2000000		// nsec
+#define TELNET_TICK_MAX		50000000	// nsec
+
+#define TN_SE			240
+#define TN_AYT			246
+#define TN_SB			250
+#define TN_WILL			251
+#define TN_WONT			252
+#define TN_DO			253
+#define TN_DONT			254
+#define TN_IAC			255
+
+#define TO_ECHO			1
+#define TO_SGA			3
+
+/* Options we do, and options we want the client to do */
+#define TO_US_OK		((1U << TO_ECHO) | (1U << TO_SGA))
+#define TO_HIM_OK		(1U << TO_SGA)
+
+enum telnet_state {
+	TS_DATA,
+	TS_IAC,
+	TS_OPT,
+	TS_SB,
+	TS_SB_IAC,
+};
+
+struct telnet_srv {
 	struct elastic			*ep;
+	int				observe;
+	TAILQ_HEAD(, telnet_conn)	conns;
+	unsigned			nconn;
+	struct telnet_conn		*ctrl;
+};
+
+struct telnet_listen {
+	struct telnet_srv		*ts;
+	int				fd;
+	struct elastic_poll		*epp;
+};
+
+struct telnet_conn {
+	TAILQ_ENTRY(telnet_conn)	list;
+	struct telnet_srv		*ts;
 	int				fd;
-	int				fd2;
-	int				telnet;
+	struct elastic_poll		*epp;
 	struct elastic_subscriber	*ws;
+
+	/* Input side */
+	enum telnet_state		state;
+	uint8_t				verb;
+	uint32_t			us;
+	uint32_t			him;
+
+	/* Output side */
+	int				half_iac;
+	nanosec				next_tx;
 };
 
 static void
-elastic_fd_txfunc(void *priv, const void *src, size_t len)
+telnet_send(const struct telnet_conn *tc, const void *ptr, size_t len)
+{
+
+	/* Short control messages, if the socket is that full, tough luck */
+	(void)write(tc->fd, ptr, len);
+}
+
+static nanosec
+telnet_tick(const struct elastic *ep)
+{
+	nanosec t;
+
+	if (ep->bits_per_sec <= 0)
+		return (0);
+	t = nsec_per_char(ep) * TELNET_BATCH;
+	if (t < TELNET_TICK_MIN)
+		t = TELNET_TICK_MIN;
+	if (t > TELNET_TICK_MAX)
+		t = TELNET_TICK_MAX;
+	return (t);
+}
+
+/*
+ * Output, with IAC doubled.  If a doubled IAC gets split by a short
+ * write, the IAC counts as delivered and the second half is sent
+ * before anything else next time, so the stream stays sane even if
+ * the elastic dropped the rest of the chunk in the meantime.
+ */
+
+static ssize_t v_matchproto_(elastic_deliver_f)
+elastic_telnet_txfunc(void *priv, const void *src, size_t len)
+{
+	struct telnet_conn *tc = priv;
+	const uint8_t *s = src;
+	uint8_t buf[BUFSIZ];
+	size_t done = 0, u, n, w;
+	ssize_t sz;
+	nanosec t = 0, tick;
+
+	tick = telnet_tick(tc->ts->ep);
+	if (tick > 0) {
+		t = now();
+		if (t < tc->next_tx) {
+			elastic_subscriber_hold(tc->ws, tc->next_tx);
+			return (0);
+		}
+	}
+	if (tc->half_iac) {
+		sz = write(tc->fd, "\xff", 1);
+		if (sz < 0 && errno == EAGAIN)
+			return (0);
+		if (sz < 0)
+			return (len);
+		tc->half_iac = 0;
+	}
+	while (done < len) {
+		for (u = done, n = 0; u < len && n + 2 <= sizeof buf; u++) {
+			buf[n++] = s[u];
+			if (s[u] == TN_IAC)
+				buf[n++] = TN_IAC;
+		}
+		sz = write(tc->fd, buf, n);
+		if (sz < 0 && errno == EAGAIN)
+			break;
+		if (sz < 0)
+			return (len);		// Reader will clean up
+		for (w = 0; w < (size_t)sz; ) {
+			if (s[done] != TN_IAC) {
+				w++;
+				done++;
+			} else if (w + 2 <= (size_t)sz) {
+				w += 2;
+				done++;
+			} else {
+				/* Owe the second half, the IAC is taken */
+				w++;
+				done++;
+				tc->half_iac = 1;
+			}
+		}
+		if ((size_t)sz < n)
+			break;
+	}
+	if (tick > 0 && done > 0)
+		tc->next_tx = t + tick;
+	return (done);
+}
+
+/*
+ * Answer option negotiation (RFC854 & RFC1143, simplified): Only
+ * reply when the state of an option changes, that way we can never
+ * get into a negotiation loop with the client.
+ */
+
+static size_t
+telnet_option(struct telnet_conn *tc, uint8_t verb, uint8_t opt, uint8_t *rp)
+{
+	uint32_t bit;
+	uint8_t reply = 0;
+
+	bit = opt < 32 ? 1U << opt : 0;
+	switch (verb) {
+	case TN_DO:
+		if (tc->us & bit)
+			break;
+		if (TO_US_OK & bit) {
+			tc->us |= bit;
+			reply = TN_WILL;
+		} else {
+			reply = TN_WONT;
+		}
+		break;
+	case TN_DONT:
+		if (tc->us & bit) {
+			tc->us &= ~bit;
+			reply = TN_WONT;
+		}
+		break;
+	case TN_WILL:
+		if (tc->him & bit)
+			break;
+		if (TO_HIM_OK & bit) {
+			tc->him |= bit;
+			reply = TN_DO;
+		} else {
+			reply = TN_DONT;
+		}
+		break;
+	case TN_WONT:
+		if (tc->him & bit) {
+			tc->him &= ~bit;
+			reply = TN_DONT;
+		}
+		break;
+	default:
+		assert(0 == __LINE__);
+	}
+	if (!reply)
+		return (0);
+	rp[0] = TN_IAC;
+	rp[1] = reply;
+	rp[2] = opt;
+	return (3);
+}
+
+static void
+telnet_close(struct telnet_conn *tc)
 {
-	struct acceptor_arg *aa = priv;
+	struct telnet_srv *ts = tc->ts;
+	struct telnet_conn *tc2 = NULL;
+	int lost = 0;
 
-	(void)write(aa->fd2, src, len);
+	elastic_poll_del(&tc->epp);
+	elastic_unsubscribe(ts->ep, tc->ws);
+	(void)close(tc->fd);
+	TAILQ_REMOVE(&ts->conns, tc, list);
+	ts->nconn--;
+	AZ(pthread_mutex_lock(&ts->ep->mtx));
+	ts->ep->watchers--;
+	if (ts->ctrl == tc) {
+		ts->ctrl = tc2 = TAILQ_FIRST(&ts->conns);
+		if (tc2 == NULL) {
+			ts->ep->carrier -= 1;
+			lost = 1;
+		}
+	}
+	AZ(pthread_mutex_unlock(&ts->ep->mtx));
+	if (lost)
+		elastic_rx_notify(ts->ep);
+	if (tc2 != NULL)
+		telnet_send(tc2, "\r\n[In control]\r\n", 16);
+	free(tc);
 }
 
-static void *
-elastic_telnet_acceptor(void *priv)
+static void v_matchproto_(elastic_poll_f)
+elastic_telnet_rx(struct elastic_poll *epp, short revents)
 {
-	struct acceptor_arg aa;
-	int fd;
-	uint8_t buf[4];
+	struct telnet_conn *tc = epp->priv;
+	struct telnet_srv *ts = tc->ts;
+	uint8_t buf[BUFSIZ], rbuf[BUFSIZ], *p, *q;
+	size_t len, rlen = 0;
 	ssize_t sz;
-	int skip;
-
-	memcpy(&aa, priv, sizeof aa);
-	free(priv);
-
-	AZ(listen(aa.fd, 0));
-	while (1) {
-		fd = accept(aa.fd, NULL, NULL);
-		aa.fd2 = fd;
-		aa.ws = elastic_subscribe(aa.ep, elastic_fd_txfunc, &aa);
-
-		buf[0] = 255;		// TELNET
-		buf[1] = 251;		// WILL
-		buf[2] = 1;		// ECHO
-		(void)write(fd, buf, 3);
-
-		buf[0] = 255;		// TELNET
-		buf[1] = 251;		// WILL
-		buf[2] = 3;		// SUPRESS_GO_AHEAD
-		(void)write(fd, buf, 3);
-
-		buf[0] = 255;		// TELNET
-		buf[1] = 253;		// DO
-		buf[2] = 3;		// SUPRESS_GO_AHEAD
-		(void)write(fd, buf, 3);
-
-		skip = 0;
-		aa.ep->carrier += 1;
-		// printf("DCD+\n");
-		while (1) {
-			sz = read(fd, buf, 1);
-			if (sz <=  0) {
-				aa.ep->carrier -= 1;
-				//printf("DCD-\n");
-				elastic_unsubscribe(aa.ep, aa.ws);
-				(void)(close(fd));
+
+	(void)revents;
+	len = elastic_in_space(ts->ep);
+	if (len > sizeof buf)
+		len = sizeof buf;
+	if (len == 0)
+		return;
+	sz = read(tc->fd, buf, len);
+	if (sz < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (sz <= 0) {
+		telnet_close(tc);
+		return;
+	}
+	for (p = q = buf; p < buf + sz; p++) {
+		switch (tc->state) {
+		case TS_DATA:
+			if (*p == TN_IAC)
+				tc->state = TS_IAC;
+			else if (*p != 0 && *p < 0x80)
+				*q++ = *p;
+			break;
+		case TS_IAC:
+			tc->state = TS_DATA;
+			switch (*p) {
+			case TN_WILL:
+			case TN_WONT:
+			case TN_DO:
+			case TN_DONT:
+				tc->verb = *p;
+				tc->state = TS_OPT;
 				break;
-			} else if (sz == 1 && buf[0]) {
-				if (skip) {
-					skip--;
-				} else if (buf[0] == 0xff) {
-					skip = 2;
-				} else if (buf[0] < 0x80) {
-					elastic_inject(aa.ep, buf, 1);
+			case TN_SB:
+				tc->state = TS_SB;
+				break;
+			case TN_AYT:
+				if (rlen + 9 <= sizeof rbuf) {
+					memcpy(rbuf + rlen, "\r\n[Yes]\r\n", 9);
+					rlen += 9;
 				}
+				break;
+			default:
+				/* IAC IAC is 0xff, 8 bit data is dropped */
+				break;
 			}
+			break;
+		case TS_OPT:
+			if (rlen + 3 <= sizeof rbuf)
+				rlen += telnet_option(tc, tc->verb, *p,
+				    rbuf + rlen);
+			tc->state = TS_DATA;
+			break;
+		case TS_SB:
+			if (*p == TN_IAC)
+				tc->state = TS_SB_IAC;
+			break;
+		case TS_SB_IAC:
+			tc->state = *p == TN_SE ? TS_DATA : TS_SB;
+			break;
+		default:
+			assert(0 == __LINE__);
 		}
 	}
+	if (rlen > 0)
+		telnet_send(tc, rbuf, rlen);
+	if (q > buf && ts->ctrl == tc)
+		elastic_inject(ts->ep, buf, q - buf);
+}
+
+static void v_matchproto_(elastic_poll_f)
+elastic_telnet_accept(struct elastic_poll *epp, short revents)
+{
+	struct telnet_listen *tl = epp->priv;
+	struct telnet_srv *ts = tl->ts;
+	struct telnet_conn *tc;
+	static const uint8_t nego[] = {
+		TN_IAC, TN_WILL, TO_ECHO,
+		TN_IAC, TN_WILL, TO_SGA,
+		TN_IAC, TN_DO, TO_SGA,
+	};
+	int fd, i, ctrl;
+
+	(void)revents;
+	fd = accept(tl->fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	if (ts->nconn >= TELNET_MAX_CONN) {
+		(void)write(fd, "Too many connections\r\n", 22);
+		(void)close(fd);
+		return;
+	}
+
+	i = 1;
+	(void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof i);
+	(void)setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &i, sizeof i);
+	i = fcntl(fd, F_GETFL);
+	assert(i != -1);
+	AZ(fcntl(fd, F_SETFL, i | O_NONBLOCK));
+
+	tc = calloc(1, sizeof *tc);
+	AN(tc);
+	tc->ts = ts;
+	tc->fd = fd;
+	tc->us = TO_US_OK;
+	tc->him = TO_HIM_OK;
+	telnet_send(tc, nego, sizeof nego);
+
+	TAILQ_INSERT_TAIL(&ts->conns, tc, list);
+	ts->nconn++;
+	ctrl = !ts->observe && ts->ctrl == NULL;
+	AZ(pthread_mutex_lock(&ts->ep->mtx));
+	ts->ep->watchers++;
+	if (ctrl) {
+		ts->ctrl = tc;
+		ts->ep->carrier += 1;
+	}
+	AZ(pthread_mutex_unlock(&ts->ep->mtx));
+	if (ctrl)
+		elastic_rx_notify(ts->ep);
+	else
+		telnet_send(tc, "\r\n[Observing]\r\n", 15);
+
+	tc->ws = elastic_subscribe(ts->ep, elastic_telnet_txfunc, tc);
+	tc->epp = elastic_poll_add(fd, POLLIN, elastic_telnet_rx, tc,
+	    ts->ep, tc->ws);
 }
 
 static int
-elastic_telnet_passive(struct elastic *ep, struct cli *cli, const char *where)
+elastic_telnet_passive(struct elastic *ep, struct cli *cli, const char *where,
+    int observe)
 {
 	struct addrinfo hints, *res, *res0;
-	int error, s;
+	int error, s, n = 0;
 	char *a, *p;
-	struct acceptor_arg *aa;
-	pthread_t pt;
+	struct telnet_srv *ts;
+	struct telnet_listen *tl;
 	int val;
 
 	a = strdup(where);
@@ -142,7 +463,11 @@ elastic_telnet_passive(struct elastic *ep, struct cli *cli, const char *where)
 		free(a);
 		return (cli_error(cli, "Error: %s\n", gai_strerror(error)));
 	}
-	s = -1;
+	ts = calloc(1, sizeof *ts);
+	AN(ts);
+	ts->ep = ep;
+	ts->observe = observe;
+	TAILQ_INIT(&ts->conns);
 	for (res = res0; res != NULL; res = res->ai_next) {
 		s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
 		if (s < 0)
@@ -152,20 +477,27 @@ elastic_telnet_passive(struct elastic *ep, struct cli *cli, const char *where)
 		AZ(setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &val, sizeof val));
 		if (bind(s, res->ai_addr, res->ai_addrlen) < 0) {
 			AZ(close(s));
-			s = -1;
 			continue;
 		}
-		aa = calloc(sizeof *aa, 1);
-		AN(aa);
-		aa->ep = ep;
-		aa->fd = s;
-		aa->telnet = 1;
-		AZ(pthread_create(&pt, NULL, elastic_telnet_acceptor, aa));
+		AZ(listen(s, TELNET_MAX_CONN));
+		val = fcntl(s, F_GETFL);
+		assert(val != -1);
+		AZ(fcntl(s, F_SETFL, val | O_NONBLOCK));
+		tl = calloc(sizeof *tl, 1);
+		AN(tl);
+		tl->ts = ts;
+		tl->fd = s;
+		tl->epp = elastic_poll_add(s, POLLIN, elastic_telnet_accept, tl,
+		    NULL, NULL);
+		n++;
 	}
+	freeaddrinfo(res0);
 	free(a);
-	if (s == -1)
+	if (n == 0) {
+		free(ts);
 		return (cli_error(cli,
 		    "Could not bind: %s\n", strerror(errno)));
+	}
 	return (0);
 }
 
@@ -208,20 +540,22 @@ elastic_tcp_active(struct elastic *ep, struct cli *cli, const char *where)
 	if (s == -1)
 		return (cli_error(cli,
 		    "Could not connect: %s\n", strerror(errno)));
-	(void)elastic_fd_start(ep, s, -1, 1);
+	(void)elastic_fd_start(ep, s, -1, ELASTIC_FD_SELFDESTRUCT);
 	return (0);
 }
 
 int v_matchproto_(cli_elastic_f)
 cli_elastic_tcp(struct elastic *ep, struct cli *cli)
 {
+	int i;
 
 	AN(cli);
 	if (cli->help) {
 		cli_printf(cli, "\ttcp <host>:<port\n");
 		cli_printf(cli, "\t\tConnect to raw TCP socket\n");
-		cli_printf(cli, "\ttelnet [<host>]:<port>\n");
-		cli_printf(cli, "\t\tStart TELNET server\n");
+		cli_printf(cli, "\ttelnet [<host>]:<port> [observe]\n");
+		cli_printf(cli, "\t\tStart TELNET server, first connection controls,\n");
+		cli_printf(cli, "\t\tthe rest (or all with 'observe') only watch\n");
 		return(0);
 	}
 	AN(ep);
@@ -235,11 +569,12 @@ cli_elastic_tcp(struct elastic *ep, struct cli *cli)
 		return (1);
 	}
 	if (!strcmp(*cli->av, "telnet")) {
-		if (cli_n_args(cli, 1))
+		i = cli->ac == 3 && !strcmp(cli->av[2], "observe");
+		if (!i && cli_n_args(cli, 1))
 			return(1);
-		(void)elastic_telnet_passive(ep, cli, cli->av[1]);
-		cli->av += 2;
-		cli->ac -= 2;
+		(void)elastic_telnet_passive(ep, cli, cli->av[1], i);
+		cli->av += 2 + i;
+		cli->ac -= 2 + i;
 		return (1);
 	}
 	return (0);
@@ -32,11 +32,11 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 #include "rc3600.h"
 #include "elastic.h"
 
 #define NCHAN 8
+#define OUT_FIFO 40
 
 #define CMD_RECEIVE		0x0
 #define CMD_STOP_RECEIVE	0x1
@@ -50,13 +50,18 @@
 #define CMD_DTR_OFF		0x9
 #define CMD_CLEAR_ONE_CHAR	0xf
 
+struct io_amx;
+
 struct amx_chan {
+	struct io_amx		*ap;
 	uint16_t		last_modem;
-	uint8_t			out_fifo[40];
+	unsigned		modem_seen;	/* Under iop->mtx */
+	uint8_t			out_fifo[OUT_FIFO];
 	unsigned		outw;
 	unsigned		outr;
 	struct elastic		*ep;
-	pthread_t		out_thread;
+	struct rc3600		*cs;
+	int			armed;
 	pthread_mutex_t		mtx;
 };
 
@@ -68,40 +73,84 @@ struct io_amx {
 	struct amx_chan		*cp;
 };
 
-static void *
-dev_amx_out_thread(void *priv)
+/*
+ * The interrupt is raised, when armed with Start, while any channel has
+ * input or a modem change the driver has not seen.  DIB tells which:
+ * 0xff00 modem changed, 0x00ff input ready, one bit per channel, and
+ * reading it acknowledges the modem changes.
+ */
+
+static uint16_t
+amx_ready(const struct io_amx *ap)
+{
+	const struct amx_chan *cp;
+	uint16_t rv = 0;
+	int i;
+
+	for (i = 0; i < NCHAN; i++) {
+		cp = &ap->chans[i];
+		if (!elastic_empty(cp->ep))
+			rv |= 0x0001 << i;
+		if (cp->modem_seen != cp->ep->carrier)
+			rv |= 0x0100 << i;
+	}
+	return (rv);
+}
+
+static void
+amx_check(struct io_amx *ap)
+{
+	struct iodev *iop = ap->iop;
+
+	if (iop->busy && amx_ready(ap)) {
+		iop->busy = 0;
+		iop->done = 1;
+		intr_raise(iop);
+	}
+}
+
+static void v_matchproto_(elastic_rx_f)
+amx_rx_notify(void *priv)
 {
-	unsigned nout;
-	uint8_t buf[1];
 	struct amx_chan *cp = priv;
-	AN(cp);
-	AN(cp->mtx);
 
-	(void)priv;
-	while (1) {
-		AZ(pthread_mutex_lock(&cp->mtx));
-		if (cp->outr != cp->outw) {
-			buf[0] = cp->out_fifo[cp->outr++];
-			cp->outr %= sizeof(cp->out_fifo);
-			nout = 1;
-		} else {
-			nout = 0;
-		}
+	AZ(pthread_mutex_lock(&cp->ap->iop->mtx));
+	amx_check(cp->ap);
+	AZ(pthread_mutex_unlock(&cp->ap->iop->mtx));
+}
+
+/*
+ * Transmission runs from a sim-time callout, which is only armed while
+ * there is something in the FIFO.  It takes one character off the FIFO
+ * and comes back when the shaper says the line is free again, so the
+ * output buffer status drains at the line rate.
+ */
+
+static void v_matchproto_(callout_cb_f)
+dev_amx_tx(void *priv, nanosec when)
+{
+	uint8_t c;
+	struct amx_chan *cp = priv;
+
+	(void)when;
+	AZ(pthread_mutex_lock(&cp->mtx));
+	if (cp->outr == cp->outw) {
+		cp->armed = 0;
 		AZ(pthread_mutex_unlock(&cp->mtx));
-		if (nout) {
-			elastic_put(cp->ep, buf, 1);
-		}
-		usleep((nsec_per_char(cp->ep) / 1000) + 1);
-		//sleep(1);
+		return;
 	}
-	return (NULL);
+	c = cp->out_fifo[cp->outr++];
+	cp->outr %= sizeof(cp->out_fifo);
+	AZ(pthread_mutex_unlock(&cp->mtx));
+	elastic_put(cp->ep, &c, 1);
+	callout_callback(cp->cs, elastic_tx_delay(cp->ep, 1), dev_amx_tx, cp);
 }
 
 static void
 dev_amx_insfunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
 {
 	struct io_amx *ap = iop->priv;
-	int cmd;
+	int cmd, i;
 	ssize_t sz;
 	uint8_t buf[2];
 
@@ -191,12 +240,22 @@ dev_amx_insfunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
 		*reg = iop->ireg_a;
 		dev_trace(iop,"AMX ioi=0x%04x *reg=0x%04x chan=0x%x DIA\n", ioi, reg ? *reg : 0, ap->chan);
 		break;
+	case IO_DIB:
+		iop->ireg_b = amx_ready(ap);
+		for (i = 0; i < NCHAN; i++)
+			ap->chans[i].modem_seen = ap->chans[i].ep->carrier;
+		dev_trace(iop,"AMX ioi=0x%04x *reg=0x%04x DIB\n", ioi, iop->ireg_b);
+		break;
 	case IO_DOB:
 		dev_trace(iop,"AMX ioi=0x%04x *reg=0x%04x chan=0x%x DOB\n", ioi, reg ? *reg : 0, ap->chan);
 		ap->chan = (*reg >> 8) & 7;
 		AZ(pthread_mutex_lock(&ap->cp->mtx));
 		ap->cp->out_fifo[ap->cp->outw++] = *reg & 0xff;
 		ap->cp->outw %= sizeof(ap->cp->out_fifo);
+		if (!ap->cp->armed) {
+			ap->cp->armed = 1;
+			callout_callback(iop->cs, 0, dev_amx_tx, ap->cp);
+		}
 		AZ(pthread_mutex_unlock(&ap->cp->mtx));
 		break;
 	case IO_DOC:
@@ -206,6 +265,7 @@ dev_amx_insfunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
 		break;
 	}
 	std_io_ins(iop, ioi, reg);
+	amx_check(ap);
 }
 
 static void * v_matchproto_(new_dev_f)
@@ -229,9 +289,11 @@ new_amx(struct iodev *iop, struct iodev *iop2)
 		AN(cp->ep);
 		cp->ep->bits_per_char = 11;
 		cp->ep->bits_per_sec = 9600;
+		cp->cs = ap->iop->cs;
+		cp->ap = ap;
+		cp->ep->rx_priv = cp;
+		cp->ep->rx_func = amx_rx_notify;
 		AZ(pthread_mutex_init(&cp->mtx, NULL))
-		AN(cp->out_fifo);
-		AZ(pthread_create(&cp->out_thread, NULL, dev_amx_out_thread, cp));
 	}
 	ap->chan = 0;
 	ap->cp = &ap->chans[ap->chan];
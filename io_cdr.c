@@ -39,64 +39,79 @@
  *        0x7760 -> BAD MASK
  */
 
+
+/*
+ * Card Reader
+ *
+ * The deck is mmap'ed, 160 bytes per card, one little-endian word per
+ * column with the twelve rows in the top bits.  A read command moves
+ * the whole card into core in one go when the card has passed the
+ * read station, and that is also when the controller is done.
+ */
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "rc3600.h"
 
+#define CDR_COLS	80
+#define CDR_CARD	(CDR_COLS * 2)
+
+/* Feed, 80 columns at 2ms and eject took 210ms before */
+#define CDR_CPM		285
+#define CDR_FAST	10000L
+
 struct io_cdr {
 	struct iodev		*iop;
-	int			fd;
+	uint8_t			*deck;
+	size_t			len;
+	size_t			ptr;
 	unsigned		card_no;
+	unsigned		cpm;		/* 0 = unlimited */
+	nanosec			when;
 };
 
-static void*
-dev_cdr_thread(void *priv)
+static void v_matchproto_(callout_cb_f)
+cdr_card_done(void *priv, nanosec when)
 {
-	struct iodev *iod = priv;
-	struct io_cdr *cp = iod->priv;
-
-	uint8_t buf[160];
-	int i;
-
-	AZ(pthread_mutex_lock(&iod->mtx));
-	while (1) {
-		while (!iod->busy)
-			AZ(pthread_cond_wait(&iod->cond, &iod->mtx));
-		assert(cp->fd >= 0);
-
-		printf("CDR @%d>@0x%04x\n", cp->card_no + 1, iod->oreg_b);
-		dev_trace(iod, "CDR >@0x%04x\n", iod->oreg_b);
-		callout_dev_sleep_locked(iod, 25000000);
-
-		i = read(cp->fd, buf, sizeof buf);
-		if (i == sizeof buf) {
-			iod->ireg_a &= ~0x0100;
-			for (i = 0; i < sizeof buf; i += 2) {
-				uint16_t u = (buf[i] | (buf[i+1]<<8)) >> 4;
-				core_write(iod->cs, iod->oreg_b, u, CORE_DMA);
-				iod->oreg_b += 1;
-				iod->ireg_b = iod->oreg_b;
-				callout_dev_sleep_locked(iod, 2000000);
-			}
+	struct io_cdr *cp = priv;
+	struct iodev *iop = cp->iop;
+	const uint8_t *p;
+	unsigned u;
+
+	AZ(pthread_mutex_lock(&iop->mtx));
+	if (iop->busy && when == cp->when) {
+		if (cp->ptr + CDR_CARD <= cp->len) {
+			iop->ireg_a &= ~0x0100;
+			p = cp->deck + cp->ptr;
+			for (u = 0; u < CDR_COLS; u++, p += 2)
+				core_write(iop->cs, iop->oreg_b++,
+				    le16dec(p) >> 4, CORE_DMA);
+			iop->ireg_b = iop->oreg_b;
+			cp->ptr += CDR_CARD;
 			cp->card_no++;
-			dev_trace(iod, "CDR #%u <@0x%04x\n", cp->card_no, iod->oreg_b);
-			callout_dev_sleep_locked(iod, 25000000);
+			dev_trace(iop, "CDR #%u <@0x%04x\n",
+			    cp->card_no, iop->oreg_b);
 		} else {
-			iod->ireg_a |= 0x0100;
+			iop->ireg_a |= 0x0100;
 		}
-		iod->done = 1;
-		intr_raise(iod);
-		iod->busy = 0;
+		iop->busy = 0;
+		iop->done = 1;
+		intr_raise(iop);
 	}
+	AZ(pthread_mutex_unlock(&iop->mtx));
 }
 
 static void
 dev_cdr_insfunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
 {
+	struct io_cdr *cp = iop->priv;
+	nanosec d;
 
 	std_io_ins(iop, ioi, reg);
 
@@ -108,8 +123,20 @@ dev_cdr_insfunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
 		iop->ireg_b = iop->oreg_b & 0x7fff;
 		break;
 	}
-}
 
+	if (IO_ACTION(ioi) == IO_START) {
+		dev_trace(iop, "CDR @%d>@0x%04x\n",
+		    cp->card_no + 1, iop->oreg_b);
+		if (cp->cpm == 0)
+			d = CDR_FAST;
+		else if (cp->ptr + CDR_CARD > cp->len)
+			d = 25000000L;		/* Hopper empty after feed */
+		else
+			d = 60000000000LL / cp->cpm;
+		cp->when = iop->cs->sim_time + d;
+		callout_callback(iop->cs, d, cdr_card_done, cp);
+	}
+}
 
 static void * v_matchproto_(new_dev_f)
 new_cdr(struct iodev *iop1, struct iodev *iop2)
@@ -122,14 +149,46 @@ new_cdr(struct iodev *iop1, struct iodev *iop2)
 
 	tp = calloc(1, sizeof *tp);
 	AN(tp);
-	tp->fd = -1;
+	tp->cpm = CDR_CPM;
 	tp->iop = iop1;
 	tp->iop->priv = tp;
 	tp->iop->io_func = dev_cdr_insfunc;
-	cpu_add_dev(tp->iop, dev_cdr_thread);
+	cpu_add_dev(tp->iop, NULL);
 	return (tp);
 }
 
+static int
+cdr_load(struct io_cdr *tp, struct cli *cli, const char *fn)
+{
+	int fd;
+	struct stat st;
+	void *p = NULL;
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		return (cli_error(cli, "Cannot open %s: %s\n",
+		    fn, strerror(errno)));
+	AZ(fstat(fd, &st));
+	if (st.st_size > 0) {
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			(void)cli_error(cli, "Cannot map %s: %s\n",
+			    fn, strerror(errno));
+			AZ(close(fd));
+			return (1);
+		}
+	}
+	AZ(close(fd));
+	AZ(pthread_mutex_lock(&tp->iop->mtx));
+	if (tp->deck != NULL)
+		AZ(munmap(tp->deck, tp->len));
+	tp->deck = p;
+	tp->len = st.st_size;
+	tp->ptr = 0;
+	AZ(pthread_mutex_unlock(&tp->iop->mtx));
+	return (0);
+}
+
 void v_matchproto_(cli_func_f)
 cli_cdr(struct cli *cli)
 {
@@ -138,6 +197,9 @@ cli_cdr(struct cli *cli)
 	if (cli->help) {
 		cli_io_help(cli, "RCxxxx Card Reader Controller", 0, 0);
 		cli_printf(cli, "\tload <filename>\n");
+		cli_printf(cli, "\t\tPut deck of cards in the hopper\n");
+		cli_printf(cli, "\tcpm [<cards per minute>|unlimited]\n");
+		cli_printf(cli, "\t\tReading speed\n");
 		return;
 	}
 
@@ -153,10 +215,32 @@ cli_cdr(struct cli *cli)
 		if (cli_dev_trace(tp->iop, cli))
 			continue;
 		if (!strcasecmp(*cli->av, "load")) {
-			tp->fd = open(cli->av[1], O_RDONLY);
-			assert(tp->fd >= 0);
+			if (!cli_n_args(cli, 1))
+				(void)cdr_load(tp, cli, cli->av[1]);
 			return;
 		}
+		if (!strcasecmp(*cli->av, "cpm")) {
+			if (cli->ac > 1 && !strcasecmp(cli->av[1], "unlimited")) {
+				tp->cpm = 0;
+				cli->ac--;
+				cli->av++;
+			} else if (cli->ac > 1) {
+				if (atoi(cli->av[1]) <= 0) {
+					cli_error(cli, "Bad cards per minute\n");
+					return;
+				}
+				tp->cpm = atoi(cli->av[1]);
+				cli->ac--;
+				cli->av++;
+			}
+			if (tp->cpm)
+				cli_printf(cli, "cpm = %u\n", tp->cpm);
+			else
+				cli_printf(cli, "cpm = unlimited\n");
+			cli->ac--;
+			cli->av++;
+			continue;
+		}
 		cli_unknown(cli);
 		break;
 	}
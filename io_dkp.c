@@ -35,6 +35,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "rc3600.h"
 
 #define BPS	512
@@ -43,15 +45,47 @@
 #define CPD	203
 
 #define DKP_SIZE	(CPD * TPC * SPT * BPS)
+#define DKP_NSECT	(CPD * TPC * SPT)
+
+/* Diablo 30 series mechanics, 1500 RPM */
+#define DKP_REV		40000000L
+#define DKP_SECT_TIME	(DKP_REV / SPT)
+#define DKP_SEEK_MIN	15000000L
+#define DKP_SEEK_MAX	70000000L
+
+/*
+ * Even in fast mode the sectors arrive one at a time: boot blocks
+ * start running when the first sector lands, and check that the
+ * controller is still busy reading the rest.
+ */
+#define DKP_FAST_SECT	10000L
+
+/*
+ * Overlay file: header with magic and a bitmap of the modified sectors,
+ * followed by the sectors at their usual offsets.  The file is sparse,
+ * so only the modified sectors take up space.
+ */
+#define OVL_HDR		4096
+#define OVL_MAGIC	"RC3600 DKP overlay v1\n"
+#define OVL_BITMAP	64
+#define OVL_SIZE	(OVL_HDR + DKP_SIZE)
 
 struct dkp_drive {
 	unsigned		drive_no;
 	struct iodev		*iop;
-	uint8_t			img[DKP_SIZE];
+	uint8_t			*img;		/* mmap'ed DKP_SIZE */
+	int			shared;
+	dev_t			st_dev;
+	ino_t			st_ino;
+	char			*base_fn;
+	uint8_t			*ovl;		/* mmap'ed OVL_SIZE or NULL */
+	char			*ovl_fn;
+	dev_t			ovl_dev;
+	ino_t			ovl_ino;
 	unsigned		cyl;
-	pthread_t		seek_thread;
-	pthread_mutex_t		seek_mtx;
-	pthread_cond_t		seek_cond;
+	nanosec			seek_when;
+	struct iostats		stats;
+	struct journal		*jnl;
 };
 
 struct io_dkp {
@@ -63,8 +97,61 @@ struct io_dkp {
 	uint16_t		nsec;
 	uint16_t		core_adr;
 	struct iodev		*iop;
+	int			fast;
 };
 
+static nanosec
+dkp_sim_time(const struct iodev *iop)
+{
+	nanosec t;
+
+	AZ(pthread_mutex_lock(&iop->cs->run_mtx));
+	t = iop->cs->sim_time;
+	AZ(pthread_mutex_unlock(&iop->cs->run_mtx));
+	return (t);
+}
+
+static void v_matchproto_(callout_cb_f)
+dkp_seek_done(void *priv, nanosec when)
+{
+	struct dkp_drive *dp = priv;
+
+	AZ(pthread_mutex_lock(&dp->iop->mtx));
+	if (when == dp->seek_when) {
+		// Not seeking
+		dp->iop->ireg_a &= ~(0x0200 >> dp->drive_no);
+
+		// Seek complete
+		dp->iop->ireg_a |= 0x4000 >> dp->drive_no;
+
+		dev_trace(dp->iop, "DKP Seek Complete\n");
+		dp->iop->done = 1;
+		intr_raise(dp->iop);
+	}
+	AZ(pthread_mutex_unlock(&dp->iop->mtx));
+}
+
+/*
+ * Called from the CPU thread with iop->mtx held.  Seek time is linear
+ * in the distance, from track-to-track to full stroke.
+ */
+
+static void
+dkp_seek(struct io_dkp *tp, struct dkp_drive *dp, unsigned cyl)
+{
+	nanosec d = 0;
+	unsigned dist;
+
+	dist = cyl > dp->cyl ? cyl - dp->cyl : dp->cyl - cyl;
+	if (dist > 0 && !tp->fast)
+		d = DKP_SEEK_MIN +
+		    (DKP_SEEK_MAX - DKP_SEEK_MIN) * (dist - 1) / (CPD - 2);
+	iostats_seek(&dp->stats, dist);
+	dp->cyl = cyl;
+	dp->seek_when = tp->iop->cs->sim_time + d;
+	callout_callback(tp->iop->cs, d, dkp_seek_done, dp);
+}
+
 static void
 dev_dkp_iofunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
 {
@@ -138,14 +225,11 @@ dev_dkp_iofunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
 		break;
 	}
 
+	if (IO_ACTION(ioi) == IO_START && !(iop->oreg_a & 0x200))
+		iostats_start(&tp->drive[tp->drv].stats, iop->cs->sim_time);
+
 	if ((iop->oreg_a & 0x200) && IO_ACTION(ioi) == IO_PULSE) {
 		dp = &tp->drive[tp->drv];
-		AZ(pthread_mutex_lock(&dp->seek_mtx));
-		if (iop->oreg_a & 0x100)
-			dp->cyl = 0;
-		else
-			dp->cyl = tp->cyl;
-		AZ(pthread_mutex_unlock(&dp->seek_mtx));
 
 		// Seeking
 		iop->ireg_a |= 0x0200 >> dp->drive_no;
@@ -153,29 +237,68 @@ dev_dkp_iofunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
 		// Not Seek Complete
 		iop->ireg_a &= ~(0x4000 >> dp->drive_no);
 
-		AZ(pthread_cond_signal(&dp->seek_cond));
+		if (iop->oreg_a & 0x100)
+			dkp_seek(tp, dp, 0);
+		else
+			dkp_seek(tp, dp, tp->cyl);
 	}
 
 }
 
+/*
+ * Sectors being written always go to the overlay, but are only marked
+ * as modified by dkp_written() once all of the sector is there.
+ */
+
+static uint8_t *
+dkp_sector(const struct dkp_drive *dd, unsigned sect, int wr)
+{
+
+	assert(sect < DKP_NSECT);
+	if (dd->ovl == NULL)
+		return (dd->img + sect * BPS);
+	if (wr || dd->ovl[OVL_BITMAP + (sect >> 3)] & (1 << (sect & 7)))
+		return (dd->ovl + OVL_HDR + sect * BPS);
+	return (dd->img + sect * BPS);
+}
+
+static void
+dkp_written(const struct dkp_drive *dd, unsigned sect)
+{
+
+	if (dd->ovl == NULL)
+		return;
+	AZ(pthread_mutex_lock(&dd->iop->mtx));
+	dd->ovl[OVL_BITMAP + (sect >> 3)] |= 1 << (sect & 7);
+	AZ(pthread_mutex_unlock(&dd->iop->mtx));
+}
+
 static void
 do_xfer(struct iodev *iop, struct io_dkp *tp, int do_disk_read)
 {
-	unsigned u;
+	unsigned u, s, n = 0;
 	uint8_t *p;
 	struct dkp_drive *dd;
+	nanosec d;
 
 	AN(iop);
 	AN(tp);
-	usleep(2000);
-	callout_dev_sleep(iop, 200000);
+	if (!tp->fast) {
+		/* Rotational latency to the first sector */
+		d = (tp->sec * DKP_SECT_TIME - dkp_sim_time(iop) % DKP_REV);
+		if (d < 0)
+			d += DKP_REV;
+		callout_dev_sleep(iop, d);
+	}
 	dd = &tp->drive[tp->drv];
 	do {
+		callout_dev_sleep(iop, tp->fast ? DKP_FAST_SECT : DKP_SECT_TIME);
 		assert(dd->cyl < 0xff);
-		u = ((((dd->cyl * TPC) + tp->hd) * SPT) + tp->sec) * BPS;
-		p = dd->img + u;
+		s = (((dd->cyl * TPC) + tp->hd) * SPT) + tp->sec;
+		p = dkp_sector(dd, s, !do_disk_read);
 		dev_trace(iop, "DKP %3d %d %2d 0x%x %d 0x%x\n",
-		    dd->cyl, tp->hd, tp->sec, u/2, tp->nsec, tp->core_adr);
+		    dd->cyl, tp->hd, tp->sec, s * BPS / 2, tp->nsec,
+		    tp->core_adr);
 		for(u = 0; u < 256; u++, p += 2, tp->core_adr++) {
 			if (do_disk_read)
 				core_write(iop->cs,
@@ -184,6 +307,10 @@ do_xfer(struct iodev *iop, struct io_dkp *tp, int do_disk_read)
 				be16enc(p, core_read(
 				    iop->cs, tp->core_adr, CORE_DMA | CORE_DATA));
 		}
+		if (!do_disk_read)
+			dkp_written(dd, s);
+		if (!do_disk_read && dd->jnl != NULL)
+			journal_dirty(dd->jnl, s);
 
 		if (++tp->sec == SPT) {
 			tp->sec = 0;
@@ -192,11 +319,14 @@ do_xfer(struct iodev *iop, struct io_dkp *tp, int do_disk_read)
 
 		tp->nsec++;
 		tp->nsec &= 0xf;
+		n++;
 		AZ(pthread_cond_signal(&iop->cs->wait_cond));
 
 	} while(tp->nsec);
 	//printf("DKP %s DONE\n", read ? "READ" : "WRITE");
+	d = dkp_sim_time(iop);
 	AZ(pthread_mutex_lock(&iop->mtx));
+	iostats_done(&dd->stats, d, !do_disk_read, n);
 
 	// RW done
 	iop->ireg_a |= 0x8000;
@@ -208,7 +338,6 @@ do_xfer(struct iodev *iop, struct io_dkp *tp, int do_disk_read)
 		tp->core_adr += 2;
 
 	AZ(pthread_mutex_unlock(&iop->mtx));
-	callout_dev_sleep(iop, 1000000);
 }
 
 static void*
@@ -254,44 +383,16 @@ dev_dkp_thread(void *priv)
 	}
 }
 
-static void *
-dkp_seek_thread(void *priv)
-{
-	struct dkp_drive *dp = priv;
-
-	while (1) {
-		AZ(pthread_mutex_lock(&dp->seek_mtx));
-		AZ(pthread_cond_wait(&dp->seek_cond, &dp->seek_mtx));
-		AZ(pthread_mutex_unlock(&dp->seek_mtx));
-
-		//printf("SEEK/RECAL BEGIN\n");
-		usleep(200);
-		//printf("SEEK/RECAL END\n");
-
-		AZ(pthread_mutex_lock(&dp->iop->mtx));
-
-		// Not seeking
-		dp->iop->ireg_a &= ~(0x0200 >> dp->drive_no);
-
-		// Seek complete
-		dp->iop->ireg_a |= 0x4000 >> dp->drive_no;
-
-		dev_trace(dp->iop, "DKP Seek Complete\n");
-		dp->iop->done = 1;
-		intr_raise(dp->iop);
-		AZ(pthread_mutex_unlock(&dp->iop->mtx));
-	}
-}
-
 static void
 new_drive(struct iodev *iop, unsigned drive, struct dkp_drive *dp)
 {
 	memset(dp, 0, sizeof *dp);
 	dp->drive_no = drive;
 	dp->iop = iop;
-	AZ(pthread_mutex_init(&dp->seek_mtx, NULL));
-	AZ(pthread_cond_init(&dp->seek_cond, NULL));
-	AZ(pthread_create(&dp->seek_thread, NULL, dkp_seek_thread, dp));
+	dp->img = mmap(NULL, DKP_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	assert(dp->img != MAP_FAILED);
+	iostats_reset(&dp->stats, 0);
 }
 
 static void * v_matchproto_(new_dev_f)
@@ -318,47 +419,443 @@ new_dkp(struct iodev *iop1, struct iodev *iop2)
 	return (tp);
 }
 
+/*
+ * Disk images are mmap'ed, so only the cylinders which are used get
+ * paged in.  'load' maps the file privately, the guest's writes stay in
+ * memory until 'save'.  'attach' maps it shared, so that the guest's
+ * writes go straight to the file.  The new image is mapped on top of
+ * the old one, so the drive's img pointer never changes.
+ */
+
+static int
+dkp_map(struct dkp_drive *dp, struct cli *cli, const char *fn, int shared)
+{
+	int fd;
+	struct stat st;
+	void *p;
+
+	fd = open(fn, shared ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (fd < 0)
+		return (cli_error(cli, "Cannot open %s: %s\n",
+		    fn, strerror(errno)));
+	AZ(fstat(fd, &st));
+	if (st.st_size < DKP_SIZE && shared && ftruncate(fd, DKP_SIZE)) {
+		(void)cli_error(cli, "Cannot extend %s: %s\n",
+		    fn, strerror(errno));
+		AZ(close(fd));
+		return (1);
+	}
+	if (st.st_size < DKP_SIZE && !shared) {
+		(void)cli_error(cli, "Read error %s: %s\n",
+		    fn, "Short disk-image");
+		AZ(close(fd));
+		return (1);
+	}
+	p = mmap(dp->img, DKP_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_FIXED | (shared ? MAP_SHARED : MAP_PRIVATE), fd, 0);
+	assert(p == dp->img);
+	AZ(close(fd));
+	dp->shared = shared;
+	dp->st_dev = st.st_dev;
+	dp->st_ino = st.st_ino;
+	p = strdup(fn);
+	AN(p);
+	free(dp->base_fn);
+	dp->base_fn = p;
+	return (0);
+}
+
 static void
-dkp_load_save(struct io_dkp *tp, struct cli *cli, int save)
+dkp_unoverlay(struct dkp_drive *dp)
+{
+
+	if (dp->ovl == NULL)
+		return;
+	AZ(munmap(dp->ovl, OVL_SIZE));
+	dp->ovl = NULL;
+	free(dp->ovl_fn);
+	dp->ovl_fn = NULL;
+}
+
+/*
+ * The base image is mapped privately and never written, the overlay is
+ * mapped shared so that the modified sectors survive in the file.
+ */
+
+static int
+dkp_overlay(struct dkp_drive *dp, struct cli *cli, const char *fn)
 {
-	int drive;
-	struct dkp_drive *dp;
 	int fd;
-	int e;
-	ssize_t sz;
+	struct stat st;
+	void *p;
+
+	fd = open(fn, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return (cli_error(cli, "Cannot open %s: %s\n",
+		    fn, strerror(errno)));
+	AZ(fstat(fd, &st));
+	if (st.st_size == 0 && (ftruncate(fd, OVL_SIZE) ||
+	    pwrite(fd, OVL_MAGIC, sizeof OVL_MAGIC, 0) != sizeof OVL_MAGIC)) {
+		(void)cli_error(cli, "Cannot create %s: %s\n",
+		    fn, strerror(errno));
+		AZ(close(fd));
+		return (1);
+	}
+	p = NULL;
+	if (st.st_size == 0 || st.st_size == OVL_SIZE)
+		p = mmap(NULL, OVL_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+	AZ(close(fd));
+	if (p == NULL || p == MAP_FAILED ||
+	    memcmp(p, OVL_MAGIC, sizeof OVL_MAGIC)) {
+		if (p != NULL && p != MAP_FAILED)
+			AZ(munmap(p, OVL_SIZE));
+		return (cli_error(cli, "%s is not a DKP overlay\n", fn));
+	}
+	dp->ovl = p;
+	dp->ovl_fn = strdup(fn);
+	AN(dp->ovl_fn);
+	dp->ovl_dev = st.st_dev;
+	dp->ovl_ino = st.st_ino;
+	return (0);
+}
 
-	if (cli_n_args(cli, 2))
+static void
+dkp_discard(struct dkp_drive *dp)
+{
+	int fd;
+#if defined(SPACECTL_DEALLOC)
+	struct spacectl_range sr;
+#endif
+
+	memset(dp->ovl + OVL_BITMAP, 0, (DKP_NSECT + 7) / 8);
+	AZ(msync(dp->ovl, OVL_HDR, MS_SYNC));
+
+	/*
+	 * Give the space back by punching a hole, truncating would pull
+	 * the pages out from under the live mapping.  Where that is not
+	 * possible, at least drop the pages from the cache.
+	 */
+	fd = open(dp->ovl_fn, O_RDWR);
+	if (fd < 0)
 		return;
+#if defined(SPACECTL_DEALLOC)
+	sr.r_offset = OVL_HDR;
+	sr.r_len = DKP_SIZE;
+	if (fspacectl(fd, SPACECTL_DEALLOC, &sr, 0, NULL))
+#elif defined(FALLOC_FL_PUNCH_HOLE)
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	    OVL_HDR, DKP_SIZE))
+#endif
+		(void)posix_fadvise(fd, OVL_HDR, DKP_SIZE,
+		    POSIX_FADV_DONTNEED);
+	AZ(close(fd));
+}
+
+/*
+ * The guest keeps the drive while the overlay sectors are written to the
+ * base image, so they are picked from a snapshot of the bitmap, and only
+ * those which still match the base afterwards are dropped from the overlay.
+ */
+
+static int
+dkp_commit(struct dkp_drive *dp, struct cli *cli)
+{
+	uint8_t bm[(DKP_NSECT + 7) / 8];
+	int fd;
+	unsigned u, kept = 0;
+	uint8_t *p;
+
+	AZ(pthread_mutex_lock(&dp->iop->mtx));
+	memcpy(bm, dp->ovl + OVL_BITMAP, sizeof bm);
+	AZ(pthread_mutex_unlock(&dp->iop->mtx));
+
+	fd = open(dp->base_fn, O_WRONLY);
+	if (fd < 0)
+		return (cli_error(cli, "Cannot open %s: %s\n",
+		    dp->base_fn, strerror(errno)));
+	for (u = 0; u < DKP_NSECT; u++) {
+		if (!(bm[u >> 3] & (1 << (u & 7))))
+			continue;
+		p = dkp_sector(dp, u, 1);
+		if (pwrite(fd, p, BPS, u * BPS) != BPS) {
+			(void)cli_error(cli, "Write error %s: %s\n",
+			    dp->base_fn, strerror(errno));
+			AZ(close(fd));
+			return (1);
+		}
+	}
+	AZ(fsync(fd));
+	AZ(close(fd));
+
+	AZ(pthread_mutex_lock(&dp->iop->mtx));
+	/* Private pages of the base may be stale now */
+	if (dkp_map(dp, cli, dp->base_fn, 0)) {
+		AZ(pthread_mutex_unlock(&dp->iop->mtx));
+		return (1);
+	}
+	for (u = 0; u < DKP_NSECT; u++) {
+		p = dp->ovl + OVL_BITMAP + (u >> 3);
+		if ((bm[u >> 3] & (1 << (u & 7))) &&
+		    !memcmp(dkp_sector(dp, u, 1), dp->img + u * BPS, BPS))
+			*p &= ~(1 << (u & 7));
+		if (*p & (1 << (u & 7)))
+			kept++;
+	}
+	if (kept == 0 && !dp->iop->busy)
+		dkp_discard(dp);
+	else
+		AZ(msync(dp->ovl, OVL_HDR, MS_SYNC));
+	AZ(pthread_mutex_unlock(&dp->iop->mtx));
+	if (kept > 0)
+		cli_printf(cli, "%u sectors written meanwhile, "
+		    "still in overlay\n", kept);
+	return (0);
+}
+
+static int
+dkp_write_image(const struct dkp_drive *dp, int fd)
+{
+	ssize_t sz;
+
+	if (dp->ovl == NULL)
+		return (pwrite(fd, dp->img, DKP_SIZE, 0) != DKP_SIZE);
+	for (sz = 0; sz < DKP_SIZE; sz += BPS)
+		if (pwrite(fd, dkp_sector(dp, sz / BPS, 0), BPS, sz) != BPS)
+			return (1);
+	return (0);
+}
+
+/*
+ * Saving onto a file the drive has mapped must not truncate it, so
+ * that case is handled in place, and everything else is written to a
+ * temporary file which is renamed over the target when complete.
+ */
+
+static int
+dkp_save(struct dkp_drive *dp, struct cli *cli, const char *fn)
+{
+	int fd, e;
+	struct stat st;
+	char *tmp;
+
+	if (!stat(fn, &st)) {
+		if (dp->ovl != NULL &&
+		    st.st_dev == dp->ovl_dev && st.st_ino == dp->ovl_ino)
+			return (cli_error(cli,
+			    "%s is the overlay of the drive\n", fn));
+		if (st.st_dev == dp->st_dev && st.st_ino == dp->st_ino) {
+			if (dp->ovl != NULL)
+				return (dkp_commit(dp, cli));
+			if (dp->shared) {
+				AZ(msync(dp->img, DKP_SIZE, MS_SYNC));
+				return (0);
+			}
+			fd = open(fn, O_WRONLY);
+			if (fd < 0)
+				return (cli_error(cli, "Cannot open %s: %s\n",
+				    fn, strerror(errno)));
+			e = dkp_write_image(dp, fd) ? errno : 0;
+			AZ(close(fd));
+			if (e)
+				return (cli_error(cli, "Write error %s: %s\n",
+				    fn, strerror(e)));
+			return (0);
+		}
+	}
+	(void)asprintf(&tmp, "%s.tmp", fn);
+	AN(tmp);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		e = errno;
+		free(tmp);
+		return (cli_error(cli, "Cannot open %s.tmp: %s\n",
+		    fn, strerror(e)));
+	}
+	e = 0;
+	if (dkp_write_image(dp, fd) || fsync(fd))
+		e = errno;
+	AZ(close(fd));
+	if (!e && rename(tmp, fn))
+		e = errno;
+	if (e)
+		(void)unlink(tmp);
+	free(tmp);
+	if (e)
+		return (cli_error(cli, "Write error %s: %s\n",
+		    fn, strerror(e)));
+	return (0);
+}
+
+static struct dkp_drive *
+dkp_drive_arg(struct io_dkp *tp, struct cli *cli, int nargs)
+{
+	int drive;
+
+	if (cli_n_args(cli, nargs))
+		return (NULL);
 	drive = atoi(cli->av[1]);
 	if (drive < 0 || drive > 3) {
 		cli_error(cli, "Drive number must be [0…3]\n");
+		return (NULL);
+	}
+	return (&tp->drive[drive]);
+}
+
+static void
+dkp_load_save(struct io_dkp *tp, struct cli *cli, int save)
+{
+	struct dkp_drive *dp;
+	int ovl;
+
+	ovl = save == 0 && cli->ac == 4;
+	dp = dkp_drive_arg(tp, cli, ovl ? 3 : 2);
+	if (dp == NULL)
+		return;
+	if (save == 1) {
+		(void)dkp_save(dp, cli, cli->av[2]);
 		return;
 	}
-	dp = &tp->drive[drive];
-	fd = open(cli->av[2],
-	    save ?  O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY,
-	    0644);
-	if (fd < 0) {
-		cli_error(cli, "Cannot open %s: %s\n",
-		    cli->av[2], strerror(errno));
+	if (dp->jnl != NULL)
+		journal_destroy(&dp->jnl);
+	dkp_unoverlay(dp);
+	if (dkp_map(dp, cli, cli->av[2], save == 2))
+		return;
+	if (ovl)
+		(void)dkp_overlay(dp, cli, cli->av[3]);
+}
+
+/*
+ * Journal writes to a privately loaded image back to its file.
+ */
+
+static void
+dkp_journal(struct io_dkp *tp, struct cli *cli)
+{
+	struct dkp_drive *dp;
+	int i;
+
+	dp = dkp_drive_arg(tp, cli, 2);
+	if (dp == NULL)
+		return;
+	if (dp->base_fn == NULL || dp->shared || dp->ovl != NULL) {
+		cli_error(cli, "Drive %u has no privately loaded image\n",
+		    dp->drive_no);
 		return;
 	}
-	if (save)
-		sz = write(fd, dp->img, sizeof dp->img);
-	else
-		sz = read(fd, dp->img, sizeof dp->img);
-	e = errno;
-	AZ(close(fd));
-	if (sz != sizeof dp->img) {
-		cli_error(cli, "%s error %s: %s\n",
-		    save ? "Write" : "Read",
-		    cli->av[2], strerror(e));
+	if (dp->jnl != NULL)
+		journal_destroy(&dp->jnl);
+	i = journal_new(&dp->jnl, cli, cli->av[2], dp->base_fn,
+	    dp->img, DKP_NSECT, BPS);
+	if (i > 0)
+		(void)dkp_map(dp, cli, dp->base_fn, 0);
+}
+
+static void
+dkp_stats(struct io_dkp *tp, struct cli *cli)
+{
+	int raw = 0, reset = 0;
+	unsigned u;
+	nanosec t;
+
+	cli->ac--;
+	cli->av++;
+	if (cli->ac && !strcasecmp(*cli->av, "raw")) {
+		raw = 1;
+		cli->ac--;
+		cli->av++;
+	} else if (cli->ac && !strcasecmp(*cli->av, "reset")) {
+		reset = 1;
+		cli->ac--;
+		cli->av++;
+	}
+	t = dkp_sim_time(tp->iop);
+	AZ(pthread_mutex_lock(&tp->iop->mtx));
+	for (u = 0; u < 4; u++) {
+		if (reset)
+			iostats_reset(&tp->drive[u].stats, t);
+		else
+			iostats_cli(cli, tp->iop, u, &tp->drive[u].stats,
+			    t, raw);
+	}
+	AZ(pthread_mutex_unlock(&tp->iop->mtx));
+}
+
+static void
+dkp_commit_discard(struct io_dkp *tp, struct cli *cli, int commit)
+{
+	struct dkp_drive *dp;
+
+	dp = dkp_drive_arg(tp, cli, 1);
+	if (dp == NULL)
+		return;
+	if (dp->ovl == NULL) {
+		cli_error(cli, "Drive %u has no overlay\n", dp->drive_no);
+		return;
+	}
+	if (commit) {
+		(void)dkp_commit(dp, cli);
+		return;
+	}
+	AZ(pthread_mutex_lock(&tp->iop->mtx));
+	if (tp->iop->busy) {
+		AZ(pthread_mutex_unlock(&tp->iop->mtx));
+		cli_error(cli, "DKP is busy\n");
 		return;
 	}
-	cli->av += 3;
-	cli->ac -= 3;
+	dkp_discard(dp);
+	AZ(pthread_mutex_unlock(&tp->iop->mtx));
 }
 
+/*
+ * Boot without AutoRom G: it recalibrates and reads sixteen sectors
+ * into core from zero, then jumps to 0377 where the boot block expects
+ * the controller to still be busy with the read.  We copy all but the
+ * last sector and leave that to the device thread.
+ */
+
+static void
+dkp_boot(struct io_dkp *tp, struct cli *cli)
+{
+	struct dkp_drive *dp;
+	struct rc3600 *cs;
+	const uint8_t *p;
+	unsigned s, u;
+
+	dp = dkp_drive_arg(tp, cli, 1);
+	if (dp == NULL)
+		return;
+	cs = tp->iop->cs;
+	cpu_stop(cs);
+	AZ(pthread_mutex_lock(&tp->iop->mtx));
+	if (tp->iop->busy) {
+		AZ(pthread_mutex_unlock(&tp->iop->mtx));
+		cli_error(cli, "DKP is busy\n");
+		return;
+	}
+	dp->cyl = 0;
+	tp->iop->ireg_a &= ~(0x0200 >> dp->drive_no);
+	tp->iop->ireg_a |= 0x4000 >> dp->drive_no;
+	for (s = 0; s < 15; s++) {
+		p = dkp_sector(dp, s, 0);
+		for (u = 0; u < 256; u++, p += 2)
+			core_write(cs, s * 256 + u, be16dec(p), CORE_DMA);
+	}
+	tp->drv = dp->drive_no;
+	tp->cyl = 0;
+	tp->hd = s / SPT;
+	tp->sec = s % SPT;
+	tp->nsec = s;
+	tp->core_adr = s * 256;
+	tp->iop->oreg_a = 0;
+	tp->iop->done = 0;
+	tp->iop->busy = 1;
+	iostats_start(&dp->stats, dkp_sim_time(tp->iop));
+	AZ(pthread_cond_signal(&tp->iop->cond));
+	AZ(pthread_mutex_unlock(&tp->iop->mtx));
+	cs->pc = 0377;
+	cpu_start(cs);
+}
 
 void v_matchproto_(cli_func_f)
 cli_dkp(struct cli *cli)
@@ -367,10 +864,26 @@ cli_dkp(struct cli *cli)
 
 	if (cli->help) {
 		cli_io_help(cli, "RC3652 \"Diablo\" disk controller", 0, 0);
-		cli_printf(cli, "\tload <0…3> <filename>\n");
-		cli_printf(cli, "\t\tLoad disk-image from file\n");
+		cli_printf(cli, "\tload <0…3> <filename> [<overlay>]\n");
+		cli_printf(cli, "\t\tLoad disk-image from file, changes stay in memory\n");
+		cli_printf(cli, "\t\tor go to the copy-on-write overlay file\n");
+		cli_printf(cli, "\tattach <0…3> <filename>\n");
+		cli_printf(cli, "\t\tUse disk-image file, changes go to file\n");
 		cli_printf(cli, "\tsave <0…3> <filename>\n");
 		cli_printf(cli, "\t\tSave disk-image to file\n");
+		cli_printf(cli, "\tjournal <0…3> <filename>\n");
+		cli_printf(cli, "\t\tWrite changes back to loaded disk-image file\n");
+		cli_printf(cli, "\t\tthrough crash-safe journal file\n");
+		cli_printf(cli, "\tcommit <0…3>\n");
+		cli_printf(cli, "\t\tWrite overlay sectors to disk-image file\n");
+		cli_printf(cli, "\tdiscard <0…3>\n");
+		cli_printf(cli, "\t\tForget overlay sectors\n");
+		cli_printf(cli, "\tboot <0…3>\n");
+		cli_printf(cli, "\t\tLoad boot block straight into core and start it\n");
+		cli_printf(cli, "\tfast [on|off]\n");
+		cli_printf(cli, "\t\tSkip seek, rotation and transfer times\n");
+		cli_printf(cli, "\tstats [raw|reset]\n");
+		cli_printf(cli, "\t\tPer drive I/O statistics\n");
 		return;
 	}
 
@@ -393,6 +906,45 @@ cli_dkp(struct cli *cli)
 			dkp_load_save(tp, cli, 1);
 			return;
 		}
+		if (!strcasecmp(*cli->av, "attach")) {
+			dkp_load_save(tp, cli, 2);
+			return;
+		}
+		if (!strcasecmp(*cli->av, "journal")) {
+			dkp_journal(tp, cli);
+			return;
+		}
+		if (!strcasecmp(*cli->av, "commit")) {
+			dkp_commit_discard(tp, cli, 1);
+			return;
+		}
+		if (!strcasecmp(*cli->av, "discard")) {
+			dkp_commit_discard(tp, cli, 0);
+			return;
+		}
+		if (!strcasecmp(*cli->av, "boot")) {
+			dkp_boot(tp, cli);
+			return;
+		}
+		if (!strcasecmp(*cli->av, "stats")) {
+			dkp_stats(tp, cli);
+			continue;
+		}
+		if (!strcasecmp(*cli->av, "fast")) {
+			if (cli->ac > 1 && !strcasecmp(cli->av[1], "on")) {
+				tp->fast = 1;
+				cli->ac--;
+				cli->av++;
+			} else if (cli->ac > 1 && !strcasecmp(cli->av[1], "off")) {
+				tp->fast = 0;
+				cli->ac--;
+				cli->av++;
+			}
+			cli_printf(cli, "fast = %s\n", tp->fast ? "on" : "off");
+			cli->ac--;
+			cli->av++;
+			continue;
+		}
 		cli_unknown(cli);
 		break;
 	}
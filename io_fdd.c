@@ -29,46 +29,102 @@
  *
  */
 
+/*
+ * RC3650 Floppy disk controller
+ *
+ * Up to four drives per controller, selected with bits 10-11 of the
+ * DOA word.  Data moves one byte per DIB/DOB instruction, so those go
+ * straight to the image and the sector buffer without further ado.
+ *
+ * Images are mmap'ed like the DKP images: 'load' privately, 'attach'
+ * shared so that writes go to the file.
+ */
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "rc3600.h"
 
 #define FDD_BPS	128
 #define FDD_SPT	26
 #define FDD_TPD	77
+#define FDD_NDRIVE	4
 
 #define FDD_SIZE	(FDD_TPD * FDD_SPT * FDD_BPS)
 
+/* 8" drive mechanics, 360 RPM */
+#define FDD_REV		166666667L
+#define FDD_SECT_TIME	(FDD_REV / FDD_SPT)
+#define FDD_STEP	6000000L
+#define FDD_SETTLE	15000000L
+#define FDD_FAST	10000L
+
+struct fdd_drive {
+	unsigned		drive_no;
+	uint8_t			*img;		/* mmap'ed FDD_SIZE */
+	int			shared;
+	dev_t			st_dev;
+	ino_t			st_ino;
+	unsigned		track;
+	struct iostats		stats;
+};
+
 struct io_fdd {
-	int			speed;
 	struct iodev		*iop;
-	uint8_t			img[FDD_SIZE];
+	struct fdd_drive	drive[FDD_NDRIVE];
+	struct fdd_drive	*dp;
+	int			fast;
+	const uint8_t		*rptr;
+	const uint8_t		*rend;
 	uint8_t			wbuf[FDD_BPS];
-	uint8_t			sect;
-	uint8_t			track;
-	unsigned		r_ptr;
 	unsigned		w_ptr;
 };
 
+static nanosec
+fdd_seek_time(const struct io_fdd *fp, unsigned dist)
+{
+
+	if (fp->fast || dist == 0)
+		return (0);
+	return (dist * FDD_STEP + FDD_SETTLE);
+}
+
+/* Rotational latency until the sector is under the head, and past it */
+static nanosec
+fdd_sector_time(const struct io_fdd *fp, unsigned sect, nanosec t)
+{
+	nanosec d;
+
+	if (fp->fast)
+		return (0);
+	d = (sect - 1) * FDD_SECT_TIME - t % FDD_REV;
+	if (d < 0)
+		d += FDD_REV;
+	return (d + FDD_SECT_TIME);
+}
+
 static void
 dev_fdd_iofunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
 {
 	struct io_fdd *fp;
+	struct fdd_drive *dp;
+	unsigned u, sect, dist;
+	nanosec t, d = 0;
 
 	fp = iop->priv;
 
 	if (IO_OPER(ioi) == IO_DIB) {
-		*reg = fp->img[fp->r_ptr++];
+		*reg = fp->rptr < fp->rend ? *fp->rptr++ : 0;
 		return;
 	}
 	if (IO_OPER(ioi) == IO_DOB) {
-		fp->wbuf[fp->w_ptr] = *reg;
 		if (fp->w_ptr < FDD_BPS)
-			fp->w_ptr++;
+			fp->wbuf[fp->w_ptr++] = *reg;
 		return;
 	}
 
@@ -77,43 +133,54 @@ dev_fdd_iofunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
 
 	std_io_ins(iop, ioi, reg);
 	if (IO_ACTION(ioi) == IO_START) {
+		dp = fp->dp = &fp->drive[(iop->oreg_a >> 10) & 3];
+		t = iop->cs->sim_time;
 		switch (iop->oreg_a & 0x0300) {
 		case 0x0000:
-			fp->sect = iop->oreg_a & 0x00ff;
-			dev_trace(iop, "FDD READ track %u sector %u\n",
-			    fp->track, fp->sect);
-			assert(fp->sect >= 1);
-			assert(fp->sect <= FDD_SPT);
-			fp->r_ptr = fp->sect - 1;
-			fp->r_ptr *= FDD_BPS;
-			fp->r_ptr += fp->track * FDD_SPT * FDD_BPS;
-			fp->w_ptr = 0;
-			break;
 		case 0x0100:
-			fp->sect = iop->oreg_a & 0x00ff;
-			dev_trace(iop, "FDD WRITE track %u sector %u\n",
-			    fp->track, fp->sect);
-			assert(fp->sect >= 1);
-			assert(fp->sect <= FDD_SPT);
-			fp->r_ptr = fp->sect - 1;
-			fp->r_ptr *= FDD_BPS;
-			fp->r_ptr += fp->track * FDD_SPT * FDD_BPS;
-			memcpy(fp->img + fp->r_ptr, fp->wbuf, FDD_BPS);
+			sect = iop->oreg_a & 0x00ff;
+			dev_trace(iop, "FDD%u %s track %u sector %u\n",
+			    dp->drive_no,
+			    iop->oreg_a & 0x0100 ? "WRITE" : "READ",
+			    dp->track, sect);
+			assert(sect >= 1);
+			assert(sect <= FDD_SPT);
+			u = ((dp->track * FDD_SPT) + sect - 1) * FDD_BPS;
+			if (iop->oreg_a & 0x0100) {
+				memcpy(dp->img + u, fp->wbuf, FDD_BPS);
+			} else {
+				fp->rptr = dp->img + u;
+				fp->rend = dp->img + FDD_SIZE;
+			}
 			fp->w_ptr = 0;
+			d = fdd_sector_time(fp, sect, t);
+			iostats_start(&dp->stats, t);
+			iostats_done(&dp->stats, t + d,
+			    iop->oreg_a & 0x0100, 1);
 			break;
 		case 0x0200:
-			dev_trace(iop, "FDD RECAL\n");
-			fp->track = 0;
+			dev_trace(iop, "FDD%u RECAL\n", dp->drive_no);
+			iostats_seek(&dp->stats, dp->track);
+			d = fdd_seek_time(fp, dp->track);
+			dp->track = 0;
 			break;
 		case 0x0300:
-			fp->track = iop->oreg_a & 0x00ff;
-			dev_trace(iop, "FDD SEEK track %u\n", fp->track);
-			assert(fp->track < FDD_TPD);
+			u = iop->oreg_a & 0x00ff;
+			dev_trace(iop, "FDD%u SEEK track %u\n",
+			    dp->drive_no, u);
+			assert(u < FDD_TPD);
+			dist = u > dp->track ? u - dp->track : dp->track - u;
+			iostats_seek(&dp->stats, dist);
+			d = fdd_seek_time(fp, dist);
+			dp->track = u;
 			break;
 		default:
 			assert(__LINE__ == 0);
 		}
-		callout_dev_is_done(iop, fp->speed);
+		/* The guests expect to see the controller busy */
+		if (d < FDD_FAST)
+			d = FDD_FAST;
+		callout_dev_is_done(iop, d);
 	}
 	if (IO_ACTION(ioi) == IO_PULSE) {
 		fp->w_ptr = 0;
@@ -124,6 +191,8 @@ static void * v_matchproto_(new_dev_f)
 new_fdd(struct iodev *iop1, struct iodev *iop2)
 {
 	struct io_fdd *fp;
+	struct fdd_drive *dp;
+	unsigned u;
 
 	AN(iop1);
 	AZ(iop2);
@@ -131,7 +200,15 @@ new_fdd(struct iodev *iop1, struct iodev *iop2)
 	fp = calloc(1, sizeof *fp);
 	AN(fp);
 	fp->iop = iop1;
-	fp->speed = 10000;
+	for (u = 0; u < FDD_NDRIVE; u++) {
+		dp = &fp->drive[u];
+		dp->drive_no = u;
+		dp->img = mmap(NULL, FDD_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_PRIVATE, -1, 0);
+		assert(dp->img != MAP_FAILED);
+	}
+	fp->dp = &fp->drive[0];
+	fp->rptr = fp->rend = fp->dp->img;
 
 	fp->iop->io_func = dev_fdd_iofunc;
 	fp->iop->priv = fp;
@@ -139,39 +216,210 @@ new_fdd(struct iodev *iop1, struct iodev *iop2)
 	return (fp);
 }
 
-static void
-fdd_load_save(struct io_fdd *fp, struct cli *cli, int save)
+/*
+ * The new image is mapped on top of the old one, so pointers into it
+ * stay valid.
+ */
+
+static int
+fdd_map(struct fdd_drive *dp, struct cli *cli, const char *fn, int shared)
 {
 	int fd;
-	int e;
-	ssize_t sz;
+	struct stat st;
+	void *p;
 
-	if (cli_n_args(cli, 1))
-		return;
-	fd = open(cli->av[1],
-	    save ?  O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY,
-	    0644);
+	fd = open(fn, shared ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (fd < 0)
+		return (cli_error(cli, "Cannot open %s: %s\n",
+		    fn, strerror(errno)));
+	AZ(fstat(fd, &st));
+	if (st.st_size < FDD_SIZE && shared && ftruncate(fd, FDD_SIZE)) {
+		(void)cli_error(cli, "Cannot extend %s: %s\n",
+		    fn, strerror(errno));
+		AZ(close(fd));
+		return (1);
+	}
+	if (st.st_size < FDD_SIZE && !shared) {
+		(void)cli_error(cli, "Read error %s: %s\n",
+		    fn, "Short floppy-image");
+		AZ(close(fd));
+		return (1);
+	}
+	p = mmap(dp->img, FDD_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_FIXED | (shared ? MAP_SHARED : MAP_PRIVATE), fd, 0);
+	assert(p == dp->img);
+	AZ(close(fd));
+	dp->shared = shared;
+	dp->st_dev = st.st_dev;
+	dp->st_ino = st.st_ino;
+	return (0);
+}
+
+/*
+ * Saving onto the file the drive has mapped must not truncate it, so
+ * that is done in place, anything else goes to a temporary file which
+ * is renamed over the target when complete.
+ */
+
+static int
+fdd_save(const struct fdd_drive *dp, struct cli *cli, const char *fn)
+{
+	int fd, e;
+	struct stat st;
+	char *tmp;
+
+	if (!stat(fn, &st) &&
+	    st.st_dev == dp->st_dev && st.st_ino == dp->st_ino) {
+		if (dp->shared) {
+			AZ(msync(dp->img, FDD_SIZE, MS_SYNC));
+			return (0);
+		}
+		fd = open(fn, O_WRONLY);
+		if (fd < 0)
+			return (cli_error(cli, "Cannot open %s: %s\n",
+			    fn, strerror(errno)));
+		e = 0;
+		if (pwrite(fd, dp->img, FDD_SIZE, 0) != FDD_SIZE)
+			e = errno;
+		AZ(close(fd));
+		if (e)
+			return (cli_error(cli, "Write error %s: %s\n",
+			    fn, strerror(e)));
+		return (0);
+	}
+	(void)asprintf(&tmp, "%s.tmp", fn);
+	AN(tmp);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 	if (fd < 0) {
-		cli_error(cli, "Cannot open %s: %s\n",
-		    cli->av[1], strerror(errno));
-		return;
+		e = errno;
+		free(tmp);
+		return (cli_error(cli, "Cannot open %s.tmp: %s\n",
+		    fn, strerror(e)));
 	}
-	if (save)
-		sz = write(fd, fp->img, sizeof fp->img);
-	else
-		sz = read(fd, fp->img, sizeof fp->img);
-	e = errno;
+	e = 0;
+	if (write(fd, dp->img, FDD_SIZE) != FDD_SIZE || fsync(fd))
+		e = errno;
 	AZ(close(fd));
-	if (sz < 0 || (size_t)sz != sizeof fp->img) {
-		cli_error(cli, "%s error %s: %s\n",
-		    save ? "Write" : "Read",
-		    cli->av[1], strerror(e));
+	if (!e && rename(tmp, fn))
+		e = errno;
+	if (e)
+		(void)unlink(tmp);
+	free(tmp);
+	if (e)
+		return (cli_error(cli, "Write error %s: %s\n",
+		    fn, strerror(e)));
+	return (0);
+}
+
+/*
+ * load/attach/save [<0…3>] <filename>
+ */
+
+static void
+fdd_load_save(struct io_fdd *fp, struct cli *cli, int save)
+{
+	struct fdd_drive *dp;
+	int drive = 0;
+
+	if (cli->ac != 2 && cli_n_args(cli, 2))
 		return;
+	if (cli->ac == 3) {
+		drive = atoi(cli->av[1]);
+		if (drive < 0 || drive >= FDD_NDRIVE) {
+			cli_error(cli, "Drive number must be [0…3]\n");
+			return;
+		}
 	}
-	cli->av += 2;
-	cli->ac -= 2;
+	dp = &fp->drive[drive];
+	if (save == 1)
+		(void)fdd_save(dp, cli, cli->av[cli->ac - 1]);
+	else
+		(void)fdd_map(dp, cli, cli->av[cli->ac - 1], save == 2);
 }
 
+static void
+fdd_stats(struct io_fdd *fp, struct cli *cli)
+{
+	int raw = 0, reset = 0;
+	unsigned u;
+	nanosec t;
+
+	cli->ac--;
+	cli->av++;
+	if (cli->ac && !strcasecmp(*cli->av, "raw")) {
+		raw = 1;
+		cli->ac--;
+		cli->av++;
+	} else if (cli->ac && !strcasecmp(*cli->av, "reset")) {
+		reset = 1;
+		cli->ac--;
+		cli->av++;
+	}
+	AZ(pthread_mutex_lock(&fp->iop->cs->run_mtx));
+	t = fp->iop->cs->sim_time;
+	AZ(pthread_mutex_unlock(&fp->iop->cs->run_mtx));
+	AZ(pthread_mutex_lock(&fp->iop->mtx));
+	for (u = 0; u < FDD_NDRIVE; u++) {
+		if (reset)
+			iostats_reset(&fp->drive[u].stats, t);
+		else
+			iostats_cli(cli, fp->iop, u, &fp->drive[u].stats,
+			    t, raw);
+	}
+	AZ(pthread_mutex_unlock(&fp->iop->mtx));
+}
+
+/*
+ * Boot without AutoRom F: it recalibrates, reads sector one and pulls
+ * big-endian words out of the controller with DIB into core from 0100,
+ * until the first of them, a negative count, has been incremented to
+ * zero.  Then it jumps to the last word.
+ */
+
+static void
+fdd_boot(struct io_fdd *fp, struct cli *cli)
+{
+	struct fdd_drive *dp;
+	struct rc3600 *cs;
+	uint16_t cnt;
+	unsigned n;
+	int drive = 0;
+
+	if (cli->ac != 1 && cli_n_args(cli, 1))
+		return;
+	if (cli->ac == 2) {
+		drive = atoi(cli->av[1]);
+		if (drive < 0 || drive >= FDD_NDRIVE) {
+			cli_error(cli, "Drive number must be [0…3]\n");
+			return;
+		}
+	}
+	cs = fp->iop->cs;
+	cpu_stop(cs);
+	AZ(pthread_mutex_lock(&fp->iop->mtx));
+	dp = fp->dp = &fp->drive[drive];
+	iostats_seek(&dp->stats, dp->track);
+	dp->track = 0;
+	fp->rptr = dp->img;
+	fp->rend = dp->img + FDD_SIZE;
+	fp->w_ptr = 0;
+	cnt = be16dec(fp->rptr);
+	if (cnt < 0x10000 - 0300) {
+		AZ(pthread_mutex_unlock(&fp->iop->mtx));
+		cli_error(cli, "No boot block on FDD%u\n", dp->drive_no);
+		return;
+	}
+	for (n = 0; cnt + n != 0x10000; n++, fp->rptr += 2)
+		core_write(cs, 0100 + n, be16dec(fp->rptr), CORE_NULL);
+	core_write(cs, 0100, 0, CORE_NULL);
+	fp->iop->oreg_a = (dp->drive_no << 10) | 1;
+	fp->iop->busy = 0;
+	fp->iop->done = 1;
+	intr_raise(fp->iop);
+	AZ(pthread_mutex_unlock(&fp->iop->mtx));
+	cs->pc = 077 + n;
+	cpu_start(cs);
+}
 
 void v_matchproto_(cli_func_f)
 cli_fdd(struct cli *cli)
@@ -180,10 +428,18 @@ cli_fdd(struct cli *cli)
 
 	if (cli->help) {
 		cli_io_help(cli, "RC3650 Floppy disk controller", 1, 0);
-		cli_printf(cli, "\tload <filename>\n");
-		cli_printf(cli, "\t\tLoad floppy-image from file\n");
-		cli_printf(cli, "\tsave <filename>\n");
+		cli_printf(cli, "\tload [<0…3>] <filename>\n");
+		cli_printf(cli, "\t\tLoad floppy-image from file, changes stay in memory\n");
+		cli_printf(cli, "\tattach [<0…3>] <filename>\n");
+		cli_printf(cli, "\t\tUse floppy-image file, changes go to file\n");
+		cli_printf(cli, "\tsave [<0…3>] <filename>\n");
 		cli_printf(cli, "\t\tSave floppy-image to file\n");
+		cli_printf(cli, "\tboot [<0…3>]\n");
+		cli_printf(cli, "\t\tLoad boot block straight into core and start it\n");
+		cli_printf(cli, "\tfast [on|off]\n");
+		cli_printf(cli, "\t\tSkip seek and rotation times\n");
+		cli_printf(cli, "\tstats [raw|reset]\n");
+		cli_printf(cli, "\t\tPer drive I/O statistics\n");
 		return;
 	}
 
@@ -205,6 +461,33 @@ cli_fdd(struct cli *cli)
 			fdd_load_save(fp, cli, 1);
 			return;
 		}
+		if (!strcasecmp(*cli->av, "attach")) {
+			fdd_load_save(fp, cli, 2);
+			return;
+		}
+		if (!strcasecmp(*cli->av, "boot")) {
+			fdd_boot(fp, cli);
+			return;
+		}
+		if (!strcasecmp(*cli->av, "stats")) {
+			fdd_stats(fp, cli);
+			continue;
+		}
+		if (!strcasecmp(*cli->av, "fast")) {
+			if (cli->ac > 1 && !strcasecmp(cli->av[1], "on")) {
+				fp->fast = 1;
+				cli->ac--;
+				cli->av++;
+			} else if (cli->ac > 1 && !strcasecmp(cli->av[1], "off")) {
+				fp->fast = 0;
+				cli->ac--;
+				cli->av++;
+			}
+			cli_printf(cli, "fast = %s\n", fp->fast ? "on" : "off");
+			cli->ac--;
+			cli->av++;
+			continue;
+		}
 		cli_unknown(cli);
 		break;
 	}
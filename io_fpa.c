@@ -0,0 +1,460 @@
+/*-
+ * Copyright (c) 2005-2020 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Inter Processor Channel
+ *
+ * Connects two emulated machines in the same process, each with its
+ * own CPU thread.  We have no documentation for the RC FPA, this is
+ * a simple block oriented model:
+ *
+ * FPAX, the transmitter side:
+ *	DOB	Memory address of block.
+ *	DOC	Word count.
+ *	DIA	Status: 0x8000 no peer, 0x4000 block clipped to FPA_MAXBLK.
+ *	DIB/DIC	Address and count of what was sent.
+ *	Start	Send the block, DONE when it has left.
+ *
+ * FPAR, the receiver side:
+ *	DOB	Memory address of buffer.
+ *	DOC	Size of buffer in words.
+ *	DIA	Status: 0x4000 block was longer than buffer, rest lost.
+ *	DIB/DIC	Address after and count of what was received.
+ *	Start	Arm receiver, DONE when a block has been received.
+ *
+ * Blocks go through a single-producer single-consumer ring per
+ * direction, so neither CPU thread ever waits for a lock held by the
+ * other.  Each block is stamped with the senders simulated time plus
+ * FPA_LATENCY, and is not delivered before the receivers simulated
+ * time has passed the stamp.
+ *
+ * Simulated time is kept in step conservatively: every FPA_TICK each
+ * machine publishes its simulated time, and if it is more than a
+ * FPA_TICK ahead of a running peer, it waits for the peer to catch up:
+ * First it yields for up to FPA_SYNC_SPIN, because the peer usually is
+ * only a moment behind, then it sleeps until the peer wakes it, looking
+ * again every FPA_SYNC_POLL in case either machine was stopped meanwhile.
+ * Because published times lag up to a tick, the two machines can
+ * be up to two ticks apart, which FPA_LATENCY covers.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rc3600.h"
+
+#define FPA_MAXBLK	4096
+#define FPA_NMSG	16		/* power of two */
+#define FPA_TICK	10000L
+#define FPA_LATENCY	(3 * FPA_TICK)
+#define FPA_WORD_TIME	1000L
+#define FPA_SYNC_SPIN	20000L		/* real time */
+#define FPA_SYNC_POLL	1000000L	/* real time */
+
+#define FPA_NOPEER	0x8000
+#define FPA_OVFL	0x4000
+
+struct fpa_msg {
+	nanosec			stamp;
+	unsigned		len;
+	uint16_t		data[FPA_MAXBLK];
+};
+
+struct fpa_ring {
+	atomic_uint		head;
+	atomic_uint		tail;
+	struct fpa_msg		msg[FPA_NMSG];
+};
+
+struct io_fpa;
+
+struct fpa_link {
+	struct io_fpa		*side[2];
+	struct fpa_ring		ring[2];	/* Written by side[n] */
+	_Atomic nanosec		sim_time[2];
+	_Atomic nanosec		wait_for[2];	/* 0: not waiting */
+	pthread_mutex_t		mtx;		/* Only for cond */
+	pthread_cond_t		cond;
+};
+
+struct io_fpa {
+	struct iodev		*r_dev;
+	struct iodev		*x_dev;
+	struct fpa_link		*link;
+	unsigned		side;
+	int			tx_pending;
+
+	uintmax_t		blocks_sent;
+	uintmax_t		words_sent;
+	uintmax_t		blocks_rcvd;
+	uintmax_t		words_rcvd;
+	uintmax_t		ring_full;
+	uintmax_t		sync_waits;
+	nanosec			sync_wait_ns;
+};
+
+static void
+fpa_send(struct io_fpa *tp)
+{
+	struct iodev *iop = tp->x_dev;
+	struct fpa_ring *rp;
+	struct fpa_msg *mp;
+	unsigned head, n, u;
+	nanosec d;
+
+	if (tp->link == NULL) {
+		iop->ireg_a = FPA_NOPEER;
+		callout_dev_is_done_abs(iop, iop->cs->sim_time);
+		return;
+	}
+	rp = &tp->link->ring[tp->side];
+	head = atomic_load_explicit(&rp->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&rp->tail, memory_order_acquire) ==
+	    FPA_NMSG) {
+		if (!tp->tx_pending)
+			tp->ring_full++;
+		tp->tx_pending = 1;
+		return;
+	}
+	tp->tx_pending = 0;
+	mp = &rp->msg[head & (FPA_NMSG - 1)];
+	n = iop->oreg_c;
+	iop->ireg_a = 0;
+	if (n > FPA_MAXBLK) {
+		n = FPA_MAXBLK;
+		iop->ireg_a = FPA_OVFL;
+	}
+	for (u = 0; u < n; u++)
+		mp->data[u] = core_read(iop->cs, iop->oreg_b++,
+		    CORE_DMA | CORE_DATA);
+	mp->len = n;
+	d = n * FPA_WORD_TIME;
+	mp->stamp = iop->cs->sim_time + d + FPA_LATENCY;
+	atomic_store_explicit(&rp->head, head + 1, memory_order_release);
+	iop->ireg_b = iop->oreg_b;
+	iop->ireg_c = n;
+	tp->blocks_sent++;
+	tp->words_sent += n;
+	dev_trace(iop, "FPAX sent %u words\n", n);
+	callout_dev_is_done_abs(iop, iop->cs->sim_time + d);
+}
+
+static void
+fpa_recv(struct io_fpa *tp)
+{
+	struct iodev *iop = tp->r_dev;
+	struct fpa_ring *rp;
+	struct fpa_msg *mp;
+	unsigned tail, n, u;
+
+	if (tp->link == NULL || !iop->busy)
+		return;
+	rp = &tp->link->ring[!tp->side];
+	tail = atomic_load_explicit(&rp->tail, memory_order_relaxed);
+	if (tail == atomic_load_explicit(&rp->head, memory_order_acquire))
+		return;
+	mp = &rp->msg[tail & (FPA_NMSG - 1)];
+	if (mp->stamp > iop->cs->sim_time)
+		return;
+	n = mp->len;
+	iop->ireg_a = 0;
+	if (n > iop->oreg_c) {
+		n = iop->oreg_c;
+		iop->ireg_a = FPA_OVFL;
+	}
+	for (u = 0; u < n; u++)
+		core_write(iop->cs, iop->oreg_b++, mp->data[u], CORE_DMA);
+	atomic_store_explicit(&rp->tail, tail + 1, memory_order_release);
+	iop->ireg_b = iop->oreg_b;
+	iop->ireg_c = n;
+	tp->blocks_rcvd++;
+	tp->words_rcvd += n;
+	dev_trace(iop, "FPAR received %u of %u words\n", n, mp->len);
+	callout_dev_is_done_abs(iop, iop->cs->sim_time);
+}
+
+/*
+ * Wait for the peer if we are too far ahead, but never for a peer
+ * which is stopped, and give up if we are being stopped ourselves.
+ */
+
+static int
+fpa_ahead(const struct io_fpa *tp, const struct rc3600 *pcs)
+{
+	const struct fpa_link *lp = tp->link;
+
+	return (tp->r_dev->cs->running && pcs->running &&
+	    tp->r_dev->cs->sim_time >
+	    atomic_load(&lp->sim_time[!tp->side]) + FPA_TICK);
+}
+
+static void
+fpa_sync(struct io_fpa *tp)
+{
+	struct rc3600 *cs = tp->r_dev->cs;
+	struct rc3600 *pcs;
+	struct fpa_link *lp = tp->link;
+	struct timespec ts;
+	nanosec t0, t;
+
+	atomic_store(&lp->sim_time[tp->side], cs->sim_time);
+	t = atomic_load(&lp->wait_for[!tp->side]);
+	if (t != 0 && cs->sim_time >= t) {
+		AZ(pthread_mutex_lock(&lp->mtx));
+		AZ(pthread_cond_broadcast(&lp->cond));
+		AZ(pthread_mutex_unlock(&lp->mtx));
+	}
+	pcs = lp->side[!tp->side]->r_dev->cs;
+	if (!fpa_ahead(tp, pcs))
+		return;
+	t0 = now();
+	while (fpa_ahead(tp, pcs) && now() < t0 + FPA_SYNC_SPIN)
+		(void)sched_yield();
+	atomic_store(&lp->wait_for[tp->side], cs->sim_time - FPA_TICK);
+	AZ(pthread_mutex_lock(&lp->mtx));
+	while (fpa_ahead(tp, pcs)) {
+		t = now() + FPA_SYNC_POLL;
+		ts.tv_sec = t / 1000000000;
+		ts.tv_nsec = t % 1000000000;
+		(void)pthread_cond_timedwait(&lp->cond, &lp->mtx, &ts);
+	}
+	AZ(pthread_mutex_unlock(&lp->mtx));
+	atomic_store(&lp->wait_for[tp->side], 0);
+	AZ(pthread_mutex_lock(&tp->r_dev->mtx));
+	tp->sync_waits++;
+	tp->sync_wait_ns += now() - t0;
+	AZ(pthread_mutex_unlock(&tp->r_dev->mtx));
+}
+
+static void
+fpa_tick(void *priv, nanosec when)
+{
+	struct io_fpa *tp = priv;
+
+	(void)when;
+	callout_callback(tp->r_dev->cs, FPA_TICK, fpa_tick, tp);
+
+	AZ(pthread_mutex_lock(&tp->x_dev->mtx));
+	if (tp->tx_pending && tp->x_dev->busy)
+		fpa_send(tp);
+	AZ(pthread_mutex_unlock(&tp->x_dev->mtx));
+
+	AZ(pthread_mutex_lock(&tp->r_dev->mtx));
+	fpa_recv(tp);
+	AZ(pthread_mutex_unlock(&tp->r_dev->mtx));
+
+	fpa_sync(tp);
+}
+
+static void
+dev_fpax_iofunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
+{
+	struct io_fpa *tp = iop->priv;
+
+	std_io_ins(iop, ioi, reg);
+
+	if (ioi == 0)
+		tp->tx_pending = 0;
+	if (IO_ACTION(ioi) == IO_START)
+		fpa_send(tp);
+}
+
+static void
+dev_fpar_iofunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
+{
+	struct io_fpa *tp = iop->priv;
+
+	std_io_ins(iop, ioi, reg);
+
+	if (IO_ACTION(ioi) == IO_START)
+		fpa_recv(tp);
+}
+
+static void * v_matchproto_(new_dev_f)
+new_fpa(struct iodev *iop1, struct iodev *iop2)
+{
+	struct io_fpa *tp;
+
+	AN(iop1);
+	AN(iop2);
+	tp = calloc(1, sizeof *tp);
+	AN(tp);
+	tp->r_dev = iop1;
+	tp->x_dev = iop2;
+
+	tp->r_dev->priv = tp;
+	tp->r_dev->io_func = dev_fpar_iofunc;
+	cpu_add_dev(tp->r_dev, NULL);
+
+	tp->x_dev->priv = tp;
+	tp->x_dev->io_func = dev_fpax_iofunc;
+	cpu_add_dev(tp->x_dev, NULL);
+	return (tp);
+}
+
+/*
+ * Build the peer machine from a CLI script, and connect its FPA
+ * with the same unit number to ours.  The peer starts out bare, and
+ * at our simulated time, so neither has to wait long for the other.
+ */
+
+static void
+fpa_peer(struct io_fpa *tp, struct cli *cli)
+{
+	struct rc3600 *cs = tp->r_dev->cs, *pcs;
+	struct io_fpa *ptp = NULL;
+	struct fpa_link *lp;
+	char nbuf[8];
+	FILE *fi;
+	unsigned u;
+
+	if (cli->ac < 2 && cli_n_args(cli, 1))
+		return;
+	if (tp->link != NULL) {
+		cli_error(cli, "%s already has a peer\n", tp->r_dev->name);
+		return;
+	}
+	fi = fopen(cli->av[1], "r");
+	if (fi == NULL) {
+		cli_error(cli, "Cannot open %s: %s\n",
+		    cli->av[1], strerror(errno));
+		return;
+	}
+	pcs = cpu_new();
+	AN(pcs);
+	AZ(pthread_mutex_lock(&cs->run_mtx));
+	pcs->sim_time = cs->sim_time;
+	AZ(pthread_mutex_unlock(&cs->run_mtx));
+
+	u = strtoul(tp->r_dev->name + 4, NULL, 10);
+	bprintf(nbuf, "fpa %u", u);
+	if (cli_exec(pcs, nbuf) || cli_from_file(pcs, fi, 1)) {
+		fclose(fi);
+		cpu_destroy(pcs);
+		cli_error(cli, "Peer script %s failed\n", cli->av[1]);
+		return;
+	}
+	fclose(fi);
+	bprintf(nbuf, "FPAR%u", u);
+	for (u = 0; u < 63; u++)
+		if (!strcmp(pcs->iodevs[u]->name, nbuf))
+			ptp = pcs->iodevs[u]->priv;
+	AN(ptp);
+
+	lp = calloc(1, sizeof *lp);
+	AN(lp);
+	AZ(pthread_mutex_init(&lp->mtx, NULL));
+	AZ(pthread_cond_init(&lp->cond, NULL));
+	lp->side[0] = tp;
+	lp->side[1] = ptp;
+	AZ(pthread_mutex_lock(&tp->r_dev->mtx));
+	tp->link = lp;
+	tp->side = 0;
+	AZ(pthread_mutex_unlock(&tp->r_dev->mtx));
+	AZ(pthread_mutex_lock(&ptp->r_dev->mtx));
+	ptp->link = lp;
+	ptp->side = 1;
+	AZ(pthread_mutex_unlock(&ptp->r_dev->mtx));
+	callout_callback(cs, FPA_TICK, fpa_tick, tp);
+	callout_callback(pcs, FPA_TICK, fpa_tick, ptp);
+	cli->ac -= 2;
+	cli->av += 2;
+}
+
+static void
+fpa_stats_side(struct cli *cli, struct io_fpa *tp, const char *what)
+{
+
+	AZ(pthread_mutex_lock(&tp->r_dev->mtx));
+	cli_printf(cli, "%s%s:\n", tp->r_dev->name, what);
+	cli_printf(cli, "\t%ju blocks (%ju words) sent, "
+	    "%ju blocks (%ju words) received\n",
+	    tp->blocks_sent, tp->words_sent,
+	    tp->blocks_rcvd, tp->words_rcvd);
+	cli_printf(cli, "\t%ju ring full, %ju sync waits (%.3f s)\n",
+	    tp->ring_full, tp->sync_waits, tp->sync_wait_ns * 1e-9);
+	cli_printf(cli, "\tsimulated time %.6f s\n",
+	    tp->r_dev->cs->sim_time * 1e-9);
+	AZ(pthread_mutex_unlock(&tp->r_dev->mtx));
+}
+
+static void
+fpa_stats(struct io_fpa *tp, struct cli *cli)
+{
+
+	fpa_stats_side(cli, tp, "");
+	if (tp->link != NULL)
+		fpa_stats_side(cli, tp->link->side[!tp->side], " (peer)");
+	cli->ac--;
+	cli->av++;
+}
+
+void v_matchproto_(cli_func_f)
+cli_fpa(struct cli *cli)
+{
+	struct io_fpa *tp;
+
+	if (cli->help) {
+		cli_io_help(cli, "Inter Processor Channel FPAR+FPAX", 1, 0);
+		cli_printf(cli, "\tpeer <filename>\n");
+		cli_printf(cli, "\t\tBuild peer machine with CLI script,"
+		    " connect to its FPA\n");
+		cli_printf(cli, "\tstats\n");
+		cli_printf(cli, "\t\tTraffic and time synchronization\n");
+		return;
+	}
+
+	cli->ac--;
+	cli->av++;
+	tp = cli_dev_get_unit(cli, "FPAR", "FPAX", new_fpa);
+	if (tp == NULL)
+		return;
+
+	while (cli->ac && !cli->status) {
+		if (cli_dev_trace(tp->r_dev, cli)) {
+			tp->x_dev->trace = tp->r_dev->trace;
+			continue;
+		}
+		if (!strcasecmp(*cli->av, "peer")) {
+			fpa_peer(tp, cli);
+			continue;
+		}
+		if (!strcasecmp(*cli->av, "stats")) {
+			fpa_stats(tp, cli);
+			continue;
+		}
+		cli_unknown(cli);
+		break;
+	}
+}
@@ -0,0 +1,357 @@
+/*-
+ * Copyright (c) 2005-2020 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Host File Transfer
+ *
+ * A paravirtual device which lets guest programs read and write host
+ * files, limited to a single directory on the host.  DOAS with the
+ * address of a command block carries out the command:
+ *
+ *	+0	command: 1 OPEN, 2 READ, 3 WRITE, 4 CLOSE
+ *	+1	channel [0…7]
+ *	+2	OPEN: filename, READ/WRITE: buffer address
+ *	+3	OPEN: 0 read, 1 write, 2 append, READ/WRITE: byte count
+ *	+4	returned byte count, zero on READ means end of file
+ *	+5	returned status, also in DIA
+ *
+ * Filenames and data are packed two bytes per word, high byte first,
+ * filenames are NUL terminated and may not contain '/' or start
+ * with '.'.
+ *
+ * "hft install <address>" deposits a five word subroutine which
+ * does the I/O with polling: JSR to it with the command block
+ * address in AC0, it returns with the status in AC0.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/endian.h>
+#include "rc3600.h"
+
+#define HFT_OPEN	1
+#define HFT_READ	2
+#define HFT_WRITE	3
+#define HFT_CLOSE	4
+
+#define HFT_OK		0
+#define HFT_ECMD	1	/* Unknown command */
+#define HFT_ECHAN	2	/* Bad channel or channel not open */
+#define HFT_ENAME	3	/* Bad filename */
+#define HFT_EHOST	4	/* Host I/O error */
+#define HFT_EDIR	5	/* No directory configured */
+
+#define HFT_NCHAN	8
+#define HFT_NAME	64
+#define HFT_TIME	10000L
+
+struct hft_chan {
+	int			fd;
+	uintmax_t		bytes_read;
+	uintmax_t		bytes_written;
+};
+
+struct io_hft {
+	struct iodev		*iop;
+	int			dirfd;
+	struct hft_chan		chan[HFT_NCHAN];
+};
+
+static unsigned
+hft_open(struct io_hft *tp, struct hft_chan *hc, uint16_t adr, uint16_t mode)
+{
+	struct iodev *iop = tp->iop;
+	char name[HFT_NAME + 1];
+	unsigned u;
+	uint16_t w;
+	int flags;
+
+	if (tp->dirfd < 0)
+		return (HFT_EDIR);
+	for (u = 0; u < HFT_NAME; u += 2) {
+		w = core_read(iop->cs, adr++, CORE_DMA | CORE_DATA);
+		name[u] = w >> 8;
+		name[u + 1] = w & 0xff;
+		if (name[u] == '\0' || name[u + 1] == '\0')
+			break;
+	}
+	name[HFT_NAME] = '\0';
+	if (u == HFT_NAME || name[0] == '\0' || name[0] == '.' ||
+	    strchr(name, '/') != NULL)
+		return (HFT_ENAME);
+	switch (mode) {
+	case 0:
+		flags = O_RDONLY;
+		break;
+	case 1:
+		flags = O_WRONLY | O_CREAT | O_TRUNC;
+		break;
+	case 2:
+		flags = O_WRONLY | O_CREAT | O_APPEND;
+		break;
+	default:
+		return (HFT_ECMD);
+	}
+	if (hc->fd >= 0)
+		AZ(close(hc->fd));
+	hc->fd = openat(tp->dirfd, name, flags | O_NOFOLLOW, 0644);
+	dev_trace(iop, "HFT open \"%s\" %u fd %d\n", name, mode, hc->fd);
+	if (hc->fd < 0)
+		return (HFT_EHOST);
+	return (HFT_OK);
+}
+
+static unsigned
+hft_read(struct io_hft *tp, struct hft_chan *hc, uint16_t adr, uint16_t *cnt)
+{
+	struct iodev *iop = tp->iop;
+	uint8_t *buf;
+	ssize_t sz;
+	unsigned u;
+
+	buf = calloc(1, *cnt + 1L);
+	AN(buf);
+	sz = read(hc->fd, buf, *cnt);
+	if (sz < 0) {
+		free(buf);
+		*cnt = 0;
+		return (HFT_EHOST);
+	}
+	for (u = 0; u < (unsigned)sz; u += 2)
+		core_write(iop->cs, adr++, be16dec(buf + u), CORE_DMA);
+	free(buf);
+	*cnt = sz;
+	hc->bytes_read += sz;
+	return (HFT_OK);
+}
+
+static unsigned
+hft_write(struct io_hft *tp, struct hft_chan *hc, uint16_t adr, uint16_t *cnt)
+{
+	struct iodev *iop = tp->iop;
+	uint8_t *buf;
+	ssize_t sz;
+	unsigned u;
+
+	buf = malloc(*cnt + 1L);
+	AN(buf);
+	for (u = 0; u < *cnt; u += 2)
+		be16enc(buf + u,
+		    core_read(iop->cs, adr++, CORE_DMA | CORE_DATA));
+	sz = write(hc->fd, buf, *cnt);
+	free(buf);
+	if (sz < 0) {
+		*cnt = 0;
+		return (HFT_EHOST);
+	}
+	*cnt = sz;
+	hc->bytes_written += sz;
+	return (HFT_OK);
+}
+
+static void
+hft_command(struct io_hft *tp)
+{
+	struct iodev *iop = tp->iop;
+	struct hft_chan *hc = NULL;
+	uint16_t blk[4], cnt = 0, adr;
+	unsigned u, sts;
+
+	adr = iop->oreg_a;
+	for (u = 0; u < 4; u++)
+		blk[u] = core_read(iop->cs, adr + u, CORE_DMA | CORE_DATA);
+	dev_trace(iop, "HFT @0x%04x cmd %u chan %u 0x%04x 0x%04x\n",
+	    adr, blk[0], blk[1], blk[2], blk[3]);
+	if (blk[1] < HFT_NCHAN)
+		hc = &tp->chan[blk[1]];
+	if (hc == NULL) {
+		sts = HFT_ECHAN;
+	} else if (blk[0] == HFT_OPEN) {
+		sts = hft_open(tp, hc, blk[2], blk[3]);
+	} else if (blk[0] != HFT_READ && blk[0] != HFT_WRITE &&
+	    blk[0] != HFT_CLOSE) {
+		sts = HFT_ECMD;
+	} else if (hc->fd < 0) {
+		sts = HFT_ECHAN;
+	} else if (blk[0] == HFT_CLOSE) {
+		AZ(close(hc->fd));
+		hc->fd = -1;
+		sts = HFT_OK;
+	} else {
+		cnt = blk[3];
+		if (blk[0] == HFT_READ)
+			sts = hft_read(tp, hc, blk[2], &cnt);
+		else
+			sts = hft_write(tp, hc, blk[2], &cnt);
+	}
+	core_write(iop->cs, adr + 4, cnt, CORE_DMA);
+	core_write(iop->cs, adr + 5, sts, CORE_DMA);
+	iop->ireg_a = sts;
+}
+
+static void
+dev_hft_iofunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
+{
+	struct io_hft *tp = iop->priv;
+
+	std_io_ins(iop, ioi, reg);
+
+	if (IO_ACTION(ioi) != IO_START)
+		return;
+
+	hft_command(tp);
+	callout_dev_is_done(iop, HFT_TIME);
+}
+
+static void * v_matchproto_(new_dev_f)
+new_hft(struct iodev *iop1, struct iodev *iop2)
+{
+	struct io_hft *tp;
+	unsigned u;
+
+	AN(iop1);
+	AZ(iop2);
+	tp = calloc(1, sizeof *tp);
+	AN(tp);
+	tp->iop = iop1;
+	tp->dirfd = -1;
+	for (u = 0; u < HFT_NCHAN; u++)
+		tp->chan[u].fd = -1;
+	tp->iop->io_func = dev_hft_iofunc;
+	tp->iop->priv = tp;
+	cpu_add_dev(tp->iop, NULL);
+	return (tp);
+}
+
+static void
+hft_install(struct io_hft *tp, struct cli *cli)
+{
+	struct iodev *iop = tp->iop;
+	uint16_t adr;
+	char *p;
+
+	if (cli->ac < 2 && cli_n_args(cli, 1))
+		return;
+	adr = strtoul(cli->av[1], &p, 0);
+	if (*p != '\0') {
+		cli_error(cli, "Bad address\n");
+		return;
+	}
+	core_write(iop->cs, adr, 0x6240 | iop->devno, CORE_NULL); // DOAS 0
+	core_write(iop->cs, adr + 1, 0x6780 | iop->devno, CORE_NULL); // SKPDN
+	core_write(iop->cs, adr + 2, 0x01ff, CORE_NULL);	// JMP .-1
+	core_write(iop->cs, adr + 3, 0x6180 | iop->devno, CORE_NULL); // DIAC 0
+	core_write(iop->cs, adr + 4, 0x0300, CORE_NULL);	// JMP 0,3
+	cli->ac -= 2;
+	cli->av += 2;
+}
+
+static void
+hft_stats(struct io_hft *tp, struct cli *cli)
+{
+	struct hft_chan *hc;
+	unsigned u;
+
+	AZ(pthread_mutex_lock(&tp->iop->mtx));
+	for (u = 0; u < HFT_NCHAN; u++) {
+		hc = &tp->chan[u];
+		if (hc->fd < 0 && !hc->bytes_read && !hc->bytes_written)
+			continue;
+		cli_printf(cli, "%s chan %u: %s, %ju read, %ju written\n",
+		    tp->iop->name, u, hc->fd < 0 ? "closed" : "open",
+		    hc->bytes_read, hc->bytes_written);
+	}
+	AZ(pthread_mutex_unlock(&tp->iop->mtx));
+	cli->ac--;
+	cli->av++;
+}
+
+void v_matchproto_(cli_func_f)
+cli_hft(struct cli *cli)
+{
+	struct io_hft *tp;
+	int fd;
+
+	if (cli->help) {
+		cli_io_help(cli, "Host File Transfer", 1, 0);
+		cli_printf(cli, "\tdir <directory>\n");
+		cli_printf(cli, "\t\tHost directory the guest can access\n");
+		cli_printf(cli, "\tinstall <address>\n");
+		cli_printf(cli, "\t\tDeposit I/O subroutine, JSR with AC0 = "
+		    "command block\n");
+		cli_printf(cli, "\tstats\n");
+		cli_printf(cli, "\t\tPer channel byte counts\n");
+		return;
+	}
+
+	cli->ac--;
+	cli->av++;
+	tp = cli_dev_get_unit(cli, "HFT", NULL, new_hft);
+	if (tp == NULL)
+		return;
+	AN(tp);
+
+	while (cli->ac && !cli->status) {
+		if (cli_dev_trace(tp->iop, cli))
+			continue;
+		if (!strcasecmp(*cli->av, "dir")) {
+			if (cli->ac < 2 && cli_n_args(cli, 1))
+				return;
+			fd = open(cli->av[1], O_RDONLY | O_DIRECTORY);
+			if (fd < 0) {
+				cli_error(cli, "Cannot open %s: %s\n",
+				    cli->av[1], strerror(errno));
+				return;
+			}
+			AZ(pthread_mutex_lock(&tp->iop->mtx));
+			if (tp->dirfd >= 0)
+				AZ(close(tp->dirfd));
+			tp->dirfd = fd;
+			AZ(pthread_mutex_unlock(&tp->iop->mtx));
+			cli->ac -= 2;
+			cli->av += 2;
+			continue;
+		}
+		if (!strcasecmp(*cli->av, "install")) {
+			hft_install(tp, cli);
+			continue;
+		}
+		if (!strcasecmp(*cli->av, "stats")) {
+			hft_stats(tp, cli);
+			continue;
+		}
+		cli_unknown(cli);
+		break;
+	}
+}
@@ -0,0 +1,205 @@
+/*-
+ * Copyright (c) 2005-2020 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Line Printer
+ *
+ * Characters are collected in a line buffer, which is put to the
+ * elastic in one piece when the line is printed.  That happens on LF
+ * and FF, when the line is full, and when something follows a CR
+ * to be printed over the line.  Printing a line takes a line time,
+ * everything else is accepted right away.
+ * A line left unfinished is printed on IORST, and before the output
+ * file is closed or replaced.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rc3600.h"
+#include "elastic.h"
+
+#define LPT_COLS	132
+#define LPT_LPM		600
+#define LPT_FAST	10000L
+
+struct io_lpt {
+	struct iodev		*iop;
+	struct elastic		*ep;
+	uint8_t			line[LPT_COLS + 1];
+	unsigned		col;
+	int			cr;
+	unsigned		lpm;		/* 0 = unlimited */
+	uintmax_t		lines;
+};
+
+/* Caller holds iop->mtx */
+
+static void
+lpt_print(struct io_lpt *tp)
+{
+
+	elastic_put(tp->ep, tp->line, tp->col);
+	tp->col = 0;
+	tp->cr = 0;
+	tp->lines++;
+}
+
+static void v_matchproto_(elastic_flush_f)
+lpt_flush(void *priv)
+{
+	struct io_lpt *tp = priv;
+
+	AZ(pthread_mutex_lock(&tp->iop->mtx));
+	if (tp->col > 0)
+		lpt_print(tp);
+	AZ(pthread_mutex_unlock(&tp->iop->mtx));
+}
+
+static void
+dev_lpt_iofunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
+{
+	struct io_lpt *tp = iop->priv;
+	nanosec d = LPT_FAST;
+	uint8_t c;
+
+	std_io_ins(iop, ioi, reg);
+
+	if (ioi == 0 && tp->col > 0)
+		lpt_print(tp);
+	if (IO_ACTION(ioi) != IO_START)
+		return;
+
+	c = iop->oreg_a & 0x7f;
+	dev_trace(iop, "LPT 0x%02x\n", c);
+	if (c == 0x00 || c == 0x7f) {
+		callout_dev_is_done(iop, d);
+		return;
+	}
+	if (tp->cr && c != 0x0a && c != 0x0c && c != 0x0d) {
+		/* Overprint, the line so far goes first */
+		lpt_print(tp);
+		if (tp->lpm > 0)
+			d = 60000000000LL / tp->lpm;
+	}
+	tp->line[tp->col++] = c;
+	if (c == 0x0d)
+		tp->cr = 1;
+	if (c == 0x0a || c == 0x0c || tp->col == sizeof tp->line) {
+		lpt_print(tp);
+		if (tp->lpm > 0)
+			d = 60000000000LL / tp->lpm;
+	}
+	callout_dev_is_done(iop, d);
+}
+
+static void * v_matchproto_(new_dev_f)
+new_lpt(struct iodev *iop1, struct iodev *iop2)
+{
+	struct io_lpt *tp;
+
+	AN(iop1);
+	AZ(iop2);
+	tp = calloc(1, sizeof *tp);
+	AN(tp);
+	tp->iop = iop1;
+	tp->ep = elastic_new(tp->iop->cs, O_WRONLY);
+	AN(tp->ep);
+	tp->lpm = LPT_LPM;
+	tp->ep->flush_func = lpt_flush;
+	tp->ep->flush_priv = tp;
+	tp->iop->io_func = dev_lpt_iofunc;
+	tp->iop->priv = tp;
+	cpu_add_dev(tp->iop, NULL);
+	return (tp);
+}
+
+void v_matchproto_(cli_func_f)
+cli_lpt(struct cli *cli)
+{
+	struct io_lpt *tp;
+
+	if (cli->help) {
+		cli_io_help(cli, "Line Printer", 1, 1);
+		cli_printf(cli, "\tlpm [<lines per minute>|unlimited]\n");
+		cli_printf(cli, "\t\tPrinting speed\n");
+		cli_printf(cli, "\tstats\n");
+		cli_printf(cli, "\t\tLines printed\n");
+		return;
+	}
+
+	cli->ac--;
+	cli->av++;
+	tp = cli_dev_get_unit(cli, "LPT", NULL, new_lpt);
+	if (tp == NULL)
+		return;
+	AN(tp);
+
+	while (cli->ac && !cli->status) {
+		if (cli_dev_trace(tp->iop, cli))
+			continue;
+		if (cli_elastic(tp->ep, cli))
+			continue;
+		if (!strcasecmp(*cli->av, "lpm")) {
+			if (cli->ac > 1 && !strcasecmp(cli->av[1], "unlimited")) {
+				tp->lpm = 0;
+				cli->ac--;
+				cli->av++;
+			} else if (cli->ac > 1) {
+				if (atoi(cli->av[1]) <= 0) {
+					cli_error(cli, "Bad lines per minute\n");
+					return;
+				}
+				tp->lpm = atoi(cli->av[1]);
+				cli->ac--;
+				cli->av++;
+			}
+			if (tp->lpm)
+				cli_printf(cli, "lpm = %u\n", tp->lpm);
+			else
+				cli_printf(cli, "lpm = unlimited\n");
+			cli->ac--;
+			cli->av++;
+			continue;
+		}
+		if (!strcasecmp(*cli->av, "stats")) {
+			AZ(pthread_mutex_lock(&tp->iop->mtx));
+			cli_printf(cli, "%s: %ju lines\n",
+			    tp->iop->name, tp->lines);
+			AZ(pthread_mutex_unlock(&tp->iop->mtx));
+			cli->ac--;
+			cli->av++;
+			continue;
+		}
+		cli_unknown(cli);
+		break;
+	}
+}
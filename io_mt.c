@@ -0,0 +1,606 @@
+/*-
+ * Copyright (c) 2005-2020 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Magnetic Tape controller
+ *
+ * We have no documentation for the RC3600 tape controller, so this
+ * follows the Data General 6026 programming model, which is also what
+ * AutoRom F's magtape load expects: DOAS with zero reads the first
+ * record into core from zero.
+ *
+ *	DOA	0x8000 clear interrupt, 0x00f8 command, 0x0007 drive
+ *	DOB/DIB	memory address
+ *	DOC/DIC	negative word or record count, zero means 65536
+ *	DIA	status
+ *
+ * Tape images are in the SIMH .tap format: each record is framed by
+ * its little-endian 32 bit length before and after, zero is a tape
+ * mark.  Images are mmap'ed and indexed when loaded, so spacing is a
+ * walk through the index.  Writes go to the file with pwrite(2) and
+ * truncate the tape after the written record, as on a real drive.
+ *
+ * The whole record moves when the command is given, the controller is
+ * done when the tape would have got there.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rc3600.h"
+
+#define MT_NDRIVE	8
+
+/* 1600 BPI at 75 IPS, 0.6" inter record gap, rewind five times faster */
+#define MT_BYTE_TIME	8333L
+#define MT_IRG		8000000L
+#define MT_REWIND	5
+#define MT_FAST		10000L
+
+#define MT_READ		000
+#define MT_REWIND_CMD	001
+#define MT_SPACEF	003
+#define MT_SPACER	004
+#define MT_WRITE	005
+#define MT_WREOF	006
+#define MT_ERASE	007
+#define MT_READNS	020
+#define MT_UNLOAD	021
+
+#define MT_ERR		0x8000
+#define MT_DLT		0x4000
+#define MT_REW		0x2000
+#define MT_ILL		0x1000
+#define MT_HDN		0x0800
+#define MT_PAR		0x0400
+#define MT_EOT		0x0200
+#define MT_EOF		0x0100
+#define MT_BOT		0x0080
+#define MT_9TK		0x0040
+#define MT_BAT		0x0020
+#define MT_WLK		0x0004
+#define MT_ODD		0x0002
+#define MT_RDY		0x0001
+
+#define MT_ERRS	(MT_DLT | MT_ILL | MT_PAR | MT_EOT | MT_EOF | MT_BAT)
+
+struct mt_rec {
+	size_t			off;
+	uint32_t		hdr;		/* 0 = tape mark */
+};
+
+struct mt_drive {
+	unsigned		drive_no;
+	int			fd;		/* -1 unless writable */
+	uint8_t			*img;
+	size_t			size;
+	int			loaded;
+	struct mt_rec		*rec;		/* nrec + end of data */
+	unsigned		nrec;
+	unsigned		nalloc;
+	unsigned		pos;
+	uint16_t		status;
+	struct iostats		stats;
+};
+
+struct io_mt {
+	struct iodev		*iop;
+	struct mt_drive		drive[MT_NDRIVE];
+	int			fast;
+};
+
+static void
+mt_rec_room(struct mt_drive *dp)
+{
+
+	if (dp->nrec + 1 < dp->nalloc)
+		return;
+	dp->nalloc += 1024;
+	dp->rec = realloc(dp->rec, dp->nalloc * sizeof *dp->rec);
+	AN(dp->rec);
+}
+
+/*
+ * Build the record index.  Odd records are padded to even length in
+ * SIMH images, but not in all others, so look for the trailer in both
+ * places.  The tape ends at an end-of-medium marker or at the first
+ * record which does not hang together.
+ */
+
+static void
+mt_index(struct mt_drive *dp)
+{
+	size_t off = 0, nxt, l;
+	uint32_t hdr;
+
+	dp->nrec = 0;
+	while (1) {
+		mt_rec_room(dp);
+		dp->rec[dp->nrec].off = off;
+		dp->rec[dp->nrec].hdr = 0;
+		if (off + 4 > dp->size)
+			break;
+		hdr = le32dec(dp->img + off);
+		if (hdr == 0xffffffff)
+			break;
+		if (hdr == 0) {
+			dp->nrec++;
+			off += 4;
+			continue;
+		}
+		l = hdr & 0xffffff;
+		nxt = off + 4 + l;
+		if (nxt + 4 <= dp->size && le32dec(dp->img + nxt) == hdr) {
+			nxt += 4;
+		} else if (nxt + 5 <= dp->size &&
+		    le32dec(dp->img + nxt + 1) == hdr) {
+			nxt += 5;
+		} else {
+			break;
+		}
+		dp->rec[dp->nrec++].hdr = hdr;
+		off = nxt;
+	}
+	if (dp->pos > dp->nrec)
+		dp->pos = dp->nrec;
+}
+
+static int
+mt_map(struct mt_drive *dp)
+{
+	struct stat st;
+	void *p = NULL;
+
+	if (dp->img != NULL)
+		AZ(munmap(dp->img, dp->size));
+	dp->img = NULL;
+	dp->size = 0;
+	AZ(fstat(dp->fd, &st));
+	if (st.st_size > 0) {
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, dp->fd, 0);
+		if (p == MAP_FAILED)
+			return (-1);
+	}
+	dp->img = p;
+	dp->size = st.st_size;
+	return (0);
+}
+
+static uint16_t
+mt_status(const struct io_mt *tp)
+{
+	const struct mt_drive *dp;
+	uint16_t s;
+
+	dp = &tp->drive[tp->iop->oreg_a & 7];
+	if (!dp->loaded)
+		return (MT_ERR | MT_ILL);
+	s = dp->status | MT_9TK | MT_HDN | MT_RDY;
+	if (dp->pos == 0)
+		s |= MT_BOT;
+	if (dp->fd < 0)
+		s |= MT_WLK;
+	if (s & MT_ERRS)
+		s |= MT_ERR;
+	return (s);
+}
+
+static nanosec
+mt_rec_time(const struct mt_rec *rp)
+{
+
+	return (MT_IRG + (rp->hdr & 0xffffff) * MT_BYTE_TIME);
+}
+
+static nanosec
+mt_read(struct io_mt *tp, struct mt_drive *dp)
+{
+	struct iodev *iop = tp->iop;
+	const struct mt_rec *rp;
+	const uint8_t *p;
+	unsigned u, len;
+	uint16_t w;
+
+	if (dp->pos == dp->nrec) {
+		dp->status |= MT_EOT;
+		return (MT_IRG);
+	}
+	rp = &dp->rec[dp->pos++];
+	if (rp->hdr == 0) {
+		dp->status |= MT_EOF;
+		return (MT_IRG);
+	}
+	len = rp->hdr & 0xffffff;
+	if (rp->hdr & 0x80000000)
+		dp->status |= MT_PAR;
+	if (len & 1)
+		dp->status |= MT_ODD;
+	if (rp->off + 4 + len > dp->size && mt_map(dp)) {
+		dp->status |= MT_BAT;
+		return (MT_IRG);
+	}
+	p = dp->img + rp->off + 4;
+	for (u = 0; u < len; u += 2) {
+		w = p[u] << 8;
+		if (u + 1 < len)
+			w |= p[u + 1];
+		core_write(iop->cs, iop->oreg_b++, w, CORE_DMA);
+		if (++iop->oreg_c == 0)
+			break;
+	}
+	return (mt_rec_time(rp));
+}
+
+static nanosec
+mt_space(struct io_mt *tp, struct mt_drive *dp, int fwd)
+{
+	struct iodev *iop = tp->iop;
+	const struct mt_rec *rp;
+	nanosec d = 0;
+
+	while (1) {
+		if (fwd && dp->pos == dp->nrec) {
+			dp->status |= MT_EOT;
+			break;
+		}
+		if (!fwd && dp->pos == 0)
+			break;
+		rp = &dp->rec[fwd ? dp->pos++ : --dp->pos];
+		d += mt_rec_time(rp);
+		if (rp->hdr == 0) {
+			dp->status |= MT_EOF;
+			break;
+		}
+		if (++iop->oreg_c == 0)
+			break;
+	}
+	return (d + MT_IRG);
+}
+
+/*
+ * Write a record (or a tape mark if len is zero) at the current
+ * position, which becomes the end of the tape.  The index is updated
+ * in place, the mapping is only extended when a read needs it.
+ */
+
+static int
+mt_write(struct mt_drive *dp, const uint8_t *buf, uint32_t len)
+{
+	size_t off;
+	uint8_t hdr[4];
+
+	off = dp->rec[dp->pos].off;
+	le32enc(hdr, len);
+	if (pwrite(dp->fd, hdr, 4, off) != 4)
+		return (-1);
+	off += 4;
+	if (len > 0) {
+		if (pwrite(dp->fd, buf, len, off) != (ssize_t)len ||
+		    pwrite(dp->fd, hdr, 4, off + len) != 4)
+			return (-1);
+		off += len + 4;
+	}
+	if (ftruncate(dp->fd, off))
+		return (-1);
+	dp->rec[dp->pos].hdr = len;
+	dp->nrec = ++dp->pos;
+	mt_rec_room(dp);
+	dp->rec[dp->nrec].off = off;
+	dp->rec[dp->nrec].hdr = 0;
+	return (0);
+}
+
+static nanosec
+mt_write_rec(struct io_mt *tp, struct mt_drive *dp)
+{
+	struct iodev *iop = tp->iop;
+	uint8_t *buf;
+	unsigned u, n;
+	uint16_t w;
+
+	n = 0x10000 - iop->oreg_c;
+	buf = malloc(n * 2L);
+	AN(buf);
+	for (u = 0; u < n; u++) {
+		w = core_read(iop->cs, iop->oreg_b++, CORE_DMA | CORE_DATA);
+		be16enc(buf + 2 * u, w);
+	}
+	iop->oreg_c = 0;
+	if (mt_write(dp, buf, n * 2))
+		dp->status |= MT_BAT;
+	free(buf);
+	return (MT_IRG + n * 2 * MT_BYTE_TIME);
+}
+
+static void
+mt_command(struct io_mt *tp)
+{
+	struct iodev *iop = tp->iop;
+	struct mt_drive *dp;
+	unsigned cmd;
+	int io = -1;
+	nanosec t, d = MT_IRG;
+
+	dp = &tp->drive[iop->oreg_a & 7];
+	cmd = (iop->oreg_a >> 3) & 037;
+	dp->status = 0;
+	dev_trace(iop, "MT%u cmd 0%o pos %u ma 0x%04x wc 0x%04x\n",
+	    dp->drive_no, cmd, dp->pos, iop->oreg_b, iop->oreg_c);
+	if (!dp->loaded) {
+		dp->status |= MT_ILL;
+	} else {
+		switch (cmd) {
+		case MT_READ:
+		case MT_READNS:
+			d = mt_read(tp, dp);
+			io = 0;
+			break;
+		case MT_REWIND_CMD:
+		case MT_UNLOAD:
+			d = MT_IRG + (nanosec)dp->rec[dp->pos].off *
+			    MT_BYTE_TIME / MT_REWIND;
+			iostats_seek(&dp->stats, dp->pos);
+			dp->pos = 0;
+			break;
+		case MT_SPACEF:
+		case MT_SPACER:
+			iostats_seek(&dp->stats, 1);
+			d = mt_space(tp, dp, cmd == MT_SPACEF);
+			break;
+		case MT_WRITE:
+		case MT_WREOF:
+			if (dp->fd < 0) {
+				dp->status |= MT_ILL;
+				break;
+			}
+			io = 1;
+			if (cmd == MT_WRITE)
+				d = mt_write_rec(tp, dp);
+			else if (mt_write(dp, NULL, 0))
+				dp->status |= MT_BAT;
+			break;
+		case MT_ERASE:
+			break;
+		default:
+			/* Mode settings */
+			break;
+		}
+	}
+	if (tp->fast || d < MT_FAST)
+		d = MT_FAST;
+	if (io >= 0) {
+		t = iop->cs->sim_time;
+		iostats_start(&dp->stats, t);
+		iostats_done(&dp->stats, t + d, io, 1);
+	}
+	callout_dev_is_done(iop, d);
+}
+
+static void
+dev_mt_iofunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
+{
+	struct io_mt *tp = iop->priv;
+
+	iop->ireg_a = mt_status(tp);
+	iop->ireg_b = iop->oreg_b;
+	iop->ireg_c = iop->oreg_c;
+
+	std_io_ins(iop, ioi, reg);
+
+	switch (IO_OPER(ioi)) {
+	case 0:	// IORST
+		iop->oreg_a = iop->oreg_b = iop->oreg_c = 0;
+		break;
+	case IO_DOA:
+		if (*reg & 0x8000) {
+			iop->done = 0;
+			intr_lower(iop);
+		}
+		break;
+	default:
+		break;
+	}
+	if (IO_ACTION(ioi) == IO_START)
+		mt_command(tp);
+}
+
+static void * v_matchproto_(new_dev_f)
+new_mt(struct iodev *iop1, struct iodev *iop2)
+{
+	struct io_mt *tp;
+	unsigned u;
+
+	AN(iop1);
+	AZ(iop2);
+
+	tp = calloc(1, sizeof *tp);
+	AN(tp);
+	tp->iop = iop1;
+	for (u = 0; u < MT_NDRIVE; u++) {
+		tp->drive[u].drive_no = u;
+		tp->drive[u].fd = -1;
+		iostats_reset(&tp->drive[u].stats, 0);
+	}
+	tp->iop->io_func = dev_mt_iofunc;
+	tp->iop->priv = tp;
+	cpu_add_dev(tp->iop, NULL);
+	return (tp);
+}
+
+static void
+mt_unload(struct mt_drive *dp)
+{
+
+	if (dp->img != NULL)
+		AZ(munmap(dp->img, dp->size));
+	if (dp->fd >= 0)
+		AZ(close(dp->fd));
+	free(dp->rec);
+	dp->img = NULL;
+	dp->size = 0;
+	dp->rec = NULL;
+	dp->nrec = 0;
+	dp->nalloc = 0;
+	dp->pos = 0;
+	dp->fd = -1;
+	dp->loaded = 0;
+}
+
+/*
+ * load/attach <0…7> <filename>
+ */
+
+static void
+mt_load(struct io_mt *tp, struct cli *cli, int writable)
+{
+	struct mt_drive *dp;
+	int drive, fd;
+
+	if (cli_n_args(cli, 2))
+		return;
+	drive = atoi(cli->av[1]);
+	if (drive < 0 || drive >= MT_NDRIVE) {
+		cli_error(cli, "Drive number must be [0…7]\n");
+		return;
+	}
+	fd = open(cli->av[2], writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (fd < 0) {
+		cli_error(cli, "Cannot open %s: %s\n",
+		    cli->av[2], strerror(errno));
+		return;
+	}
+	AZ(pthread_mutex_lock(&tp->iop->mtx));
+	dp = &tp->drive[drive];
+	mt_unload(dp);
+	dp->fd = fd;
+	if (mt_map(dp)) {
+		cli_error(cli, "Cannot map %s: %s\n",
+		    cli->av[2], strerror(errno));
+		mt_unload(dp);
+	} else {
+		mt_index(dp);
+		dp->loaded = 1;
+		if (!writable) {
+			/* The mapping keeps the file */
+			AZ(close(dp->fd));
+			dp->fd = -1;
+		}
+		cli_printf(cli, "MT%u: %u records\n", dp->drive_no, dp->nrec);
+	}
+	AZ(pthread_mutex_unlock(&tp->iop->mtx));
+}
+
+static void
+mt_stats(struct io_mt *tp, struct cli *cli)
+{
+	unsigned u;
+	nanosec t;
+
+	AZ(pthread_mutex_lock(&tp->iop->cs->run_mtx));
+	t = tp->iop->cs->sim_time;
+	AZ(pthread_mutex_unlock(&tp->iop->cs->run_mtx));
+	AZ(pthread_mutex_lock(&tp->iop->mtx));
+	for (u = 0; u < MT_NDRIVE; u++) {
+		if (!tp->drive[u].loaded)
+			continue;
+		cli_printf(cli, "%s drive %u: record %u of %u\n",
+		    tp->iop->name, u, tp->drive[u].pos, tp->drive[u].nrec);
+		iostats_cli(cli, tp->iop, u, &tp->drive[u].stats, t, 0);
+	}
+	AZ(pthread_mutex_unlock(&tp->iop->mtx));
+	cli->ac--;
+	cli->av++;
+}
+
+void v_matchproto_(cli_func_f)
+cli_mt(struct cli *cli)
+{
+	struct io_mt *tp;
+
+	if (cli->help) {
+		cli_io_help(cli, "Magnetic Tape controller", 1, 0);
+		cli_printf(cli, "\tload <0…7> <filename>\n");
+		cli_printf(cli, "\t\tMount .tap tape-image write-protected\n");
+		cli_printf(cli, "\tattach <0…7> <filename>\n");
+		cli_printf(cli, "\t\tMount .tap tape-image, writes go to file\n");
+		cli_printf(cli, "\tfast [on|off]\n");
+		cli_printf(cli, "\t\tSkip tape motion times\n");
+		cli_printf(cli, "\tstats\n");
+		cli_printf(cli, "\t\tPer drive position and I/O statistics\n");
+		return;
+	}
+
+	cli->ac--;
+	cli->av++;
+	tp = cli_dev_get_unit(cli, "MT", NULL, new_mt);
+	if (tp == NULL)
+		return;
+	AN(tp);
+
+	while (cli->ac && !cli->status) {
+		if (cli_dev_trace(tp->iop, cli))
+			continue;
+		if (!strcasecmp(*cli->av, "load")) {
+			mt_load(tp, cli, 0);
+			return;
+		}
+		if (!strcasecmp(*cli->av, "attach")) {
+			mt_load(tp, cli, 1);
+			return;
+		}
+		if (!strcasecmp(*cli->av, "stats")) {
+			mt_stats(tp, cli);
+			continue;
+		}
+		if (!strcasecmp(*cli->av, "fast")) {
+			if (cli->ac > 1 && !strcasecmp(cli->av[1], "on")) {
+				tp->fast = 1;
+				cli->ac--;
+				cli->av++;
+			} else if (cli->ac > 1 && !strcasecmp(cli->av[1], "off")) {
+				tp->fast = 0;
+				cli->ac--;
+				cli->av++;
+			}
+			cli_printf(cli, "fast = %s\n", tp->fast ? "on" : "off");
+			cli->ac--;
+			cli->av++;
+			continue;
+		}
+		cli_unknown(cli);
+		break;
+	}
+}
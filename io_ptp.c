@@ -48,6 +48,7 @@ dev_ptp_thread(void *priv)
 	struct io_ptp *tp = iod->priv;
 	uint16_t u;
 	char buf[2];
+	nanosec d;
 
 	AZ(pthread_mutex_lock(&iod->mtx));
 	while (1) {
@@ -58,8 +59,9 @@ dev_ptp_thread(void *priv)
 		dev_trace(iod, "PTP 0x%02x\n", u);
 		buf[0] = u;
 		elastic_put(tp->ep, buf, 1);
-		if (tp->ep->bits_per_sec > 0)
-			callout_dev_sleep(iod, nsec_per_char(tp->ep));
+		d = elastic_tx_delay(tp->ep, 1);
+		if (d > 0)
+			callout_dev_sleep(iod, d);
 		AZ(pthread_mutex_lock(&iod->mtx));
 		iod->busy = 0;
 		iod->done = 1;
@@ -48,10 +48,12 @@ dev_ptr_thread(void *priv)
 	struct io_ptr *tp = iod->priv;
 	uint8_t buf[1];
 	ssize_t sz;
+	nanosec d;
 
 	while (1) {
-		if (tp->ep->bits_per_sec > 0)
-			callout_dev_sleep(iod, nsec_per_char(tp->ep));
+		d = elastic_rx_delay(tp->ep, 1);
+		if (d > 0)
+			callout_dev_sleep(iod, d);
 
 		sz = elastic_get(tp->ep, buf, 1);
 		assert(sz == 1);
@@ -0,0 +1,375 @@
+/*-
+ * Copyright (c) 2005-2020 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * 64 line asynchronous multiplexor
+ * ================================
+ *
+ * No documentation of the TMX has surfaced, so the programming model
+ * is our own, built for many lines on few instructions:
+ *
+ * TMXO, the transmitter side:
+ *	DOA	0x3f00 line, 0x00ff character, queued on that line.
+ *	DOB	0x003f selects the line DIA reports on.
+ *	DIA	Status of the last line addressed:
+ *		0x8000 room in FIFO, 0x4000 FIFO empty, 0x2000 carrier.
+ *	DIB	Next line which has gone idle since last asked:
+ *		0x8000 | line, 0x0000 if none.
+ *	Start	DONE and interrupt when a line goes idle.
+ *
+ * TMXI, the receiver side:
+ *	DOA	0x003f line, 0x8000 receiver on, otherwise off.
+ *	DIA	Next received character:
+ *		0x8000 | line << 8 | character, 0x0000 if none.
+ *	Start	DONE and interrupt when a character is in the FIFO.
+ *
+ * There is no thread per line, or at all.  Receive is driven by the
+ * elastic buffers telling us when input arrives, after that each line
+ * is paced by a callout for as long as it has input.  Transmit is paced
+ * by a callout which is only armed when the line has output queued.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "rc3600.h"
+#include "elastic.h"
+
+#define TMX_NLINE	64
+#define TMX_OUT_FIFO	64		/* power of two */
+#define TMX_RX_FIFO	128		/* power of two */
+
+struct io_tmx;
+
+struct tmx_line {
+	struct io_tmx		*tp;
+	unsigned		line;
+	struct elastic		*ep;
+
+	/* Under o_dev->mtx */
+	uint8_t			out_fifo[TMX_OUT_FIFO];
+	unsigned		outw;
+	unsigned		outr;
+	int			tx_armed;
+
+	/* Under i_dev->mtx */
+	int			rx_on;
+	int			rx_armed;
+};
+
+struct io_tmx {
+	struct iodev		*i_dev;
+	struct iodev		*o_dev;
+	struct tmx_line		lines[TMX_NLINE];
+
+	/* Under o_dev->mtx */
+	unsigned		sel;
+	uint64_t		tx_idle;
+
+	/* Under i_dev->mtx */
+	uint16_t		rx_fifo[TMX_RX_FIFO];
+	unsigned		rx_rd;
+	unsigned		rx_wr;
+};
+
+/* Transmitter ********************************************************/
+
+static void
+tmx_tx_check(struct io_tmx *tp)
+{
+	struct iodev *iop = tp->o_dev;
+
+	if (iop->busy && tp->tx_idle) {
+		iop->busy = 0;
+		iop->done = 1;
+		intr_raise(iop);
+	}
+}
+
+static void v_matchproto_(callout_cb_f)
+tmx_tx(void *priv, nanosec when)
+{
+	struct tmx_line *lp = priv;
+	struct io_tmx *tp = lp->tp;
+	uint8_t buf[TMX_OUT_FIFO];
+	unsigned nout;
+
+	(void)when;
+	AZ(pthread_mutex_lock(&tp->o_dev->mtx));
+	nout = 0;
+	while (lp->outr != lp->outw)
+		buf[nout++] = lp->out_fifo[lp->outr++ % TMX_OUT_FIFO];
+	if (nout == 0) {
+		lp->tx_armed = 0;
+		tp->tx_idle |= 1ULL << lp->line;
+		tmx_tx_check(tp);
+	}
+	AZ(pthread_mutex_unlock(&tp->o_dev->mtx));
+	if (nout == 0)
+		return;
+	elastic_put(lp->ep, buf, nout);
+	callout_callback(tp->o_dev->cs,
+	    elastic_tx_delay(lp->ep, nout), tmx_tx, lp);
+}
+
+static void
+dev_tmxo_iofunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
+{
+	struct io_tmx *tp = iop->priv;
+	struct tmx_line *lp;
+	int i;
+
+	std_io_ins(iop, ioi, reg);
+
+	switch(IO_OPER(ioi)) {
+	case IO_DOA:
+		tp->sel = (*reg >> 8) & 0x3f;
+		lp = &tp->lines[tp->sel];
+		dev_trace(iop, "TMXO line %u char 0x%02x\n",
+		    lp->line, *reg & 0xff);
+		if (lp->outw - lp->outr < TMX_OUT_FIFO)
+			lp->out_fifo[lp->outw++ % TMX_OUT_FIFO] = *reg & 0xff;
+		tp->tx_idle &= ~(1ULL << lp->line);
+		if (!lp->tx_armed) {
+			lp->tx_armed = 1;
+			callout_callback(iop->cs, 0, tmx_tx, lp);
+		}
+		break;
+	case IO_DOB:
+		tp->sel = *reg & 0x3f;
+		break;
+	case IO_DIA:
+		lp = &tp->lines[tp->sel];
+		*reg = 0;
+		if (lp->outw - lp->outr < TMX_OUT_FIFO)
+			*reg |= 0x8000;
+		if (lp->outw == lp->outr)
+			*reg |= 0x4000;
+		if (lp->ep->carrier)
+			*reg |= 0x2000;
+		*reg |= lp->line;
+		break;
+	case IO_DIB:
+		i = ffsll(tp->tx_idle);
+		if (i == 0) {
+			*reg = 0;
+		} else {
+			tp->tx_idle &= ~(1ULL << (i - 1));
+			*reg = 0x8000 | (i - 1);
+		}
+		break;
+	default:
+		break;
+	}
+	tmx_tx_check(tp);
+}
+
+/* Receiver ***********************************************************/
+
+static void
+tmx_rx_check(struct io_tmx *tp)
+{
+	struct iodev *iop = tp->i_dev;
+
+	if (iop->busy && tp->rx_rd != tp->rx_wr) {
+		iop->busy = 0;
+		iop->done = 1;
+		intr_raise(iop);
+	}
+}
+
+static void v_matchproto_(callout_cb_f)
+tmx_rx(void *priv, nanosec when)
+{
+	struct tmx_line *lp = priv;
+	struct io_tmx *tp = lp->tp;
+	uint8_t buf[1];
+	nanosec d;
+
+	(void)when;
+	AZ(pthread_mutex_lock(&tp->i_dev->mtx));
+	if (!lp->rx_on || elastic_empty(lp->ep)) {
+		lp->rx_armed = 0;
+		AZ(pthread_mutex_unlock(&tp->i_dev->mtx));
+		return;
+	}
+	if (tp->rx_wr - tp->rx_rd < TMX_RX_FIFO) {
+		AN(elastic_get(lp->ep, buf, 1));
+		dev_trace(tp->i_dev, "TMXI line %u char 0x%02x\n",
+		    lp->line, buf[0]);
+		tp->rx_fifo[tp->rx_wr++ % TMX_RX_FIFO] =
+		    0x8000 | lp->line << 8 | buf[0];
+		tmx_rx_check(tp);
+		d = elastic_rx_delay(lp->ep, 1);
+	} else {
+		/* FIFO full, try again one character later */
+		d = nsec_per_char(lp->ep);
+	}
+	callout_callback(tp->i_dev->cs, d, tmx_rx, lp);
+	AZ(pthread_mutex_unlock(&tp->i_dev->mtx));
+}
+
+static void
+tmx_rx_arm(struct tmx_line *lp)
+{
+
+	if (lp->rx_on && !lp->rx_armed) {
+		lp->rx_armed = 1;
+		callout_callback(lp->tp->i_dev->cs, 0, tmx_rx, lp);
+	}
+}
+
+static void v_matchproto_(elastic_rx_f)
+tmx_rx_notify(void *priv)
+{
+	struct tmx_line *lp = priv;
+
+	AZ(pthread_mutex_lock(&lp->tp->i_dev->mtx));
+	tmx_rx_arm(lp);
+	AZ(pthread_mutex_unlock(&lp->tp->i_dev->mtx));
+}
+
+static void
+dev_tmxi_iofunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
+{
+	struct io_tmx *tp = iop->priv;
+	struct tmx_line *lp;
+
+	std_io_ins(iop, ioi, reg);
+
+	switch(IO_OPER(ioi)) {
+	case IO_DOA:
+		lp = &tp->lines[*reg & 0x3f];
+		lp->rx_on = (*reg >> 15) & 1;
+		dev_trace(iop, "TMXI line %u %s\n",
+		    lp->line, lp->rx_on ? "on" : "off");
+		if (!elastic_empty(lp->ep))
+			tmx_rx_arm(lp);
+		break;
+	case IO_DIA:
+		if (tp->rx_rd == tp->rx_wr)
+			*reg = 0;
+		else
+			*reg = tp->rx_fifo[tp->rx_rd++ % TMX_RX_FIFO];
+		break;
+	default:
+		break;
+	}
+	tmx_rx_check(tp);
+}
+
+/**********************************************************************/
+
+static void * v_matchproto_(new_dev_f)
+new_tmx(struct iodev *iop1, struct iodev *iop2)
+{
+	struct io_tmx *tp;
+	struct tmx_line *lp;
+	unsigned u;
+
+	AN(iop1);
+	AN(iop2);
+	tp = calloc(1, sizeof *tp);
+	AN(tp);
+	tp->i_dev = iop1;
+	tp->o_dev = iop2;
+
+	for (u = 0; u < TMX_NLINE; u++) {
+		lp = &tp->lines[u];
+		lp->tp = tp;
+		lp->line = u;
+		lp->ep = elastic_new(tp->i_dev->cs, O_RDWR);
+		AN(lp->ep);
+		lp->ep->bits_per_char = 11;
+		lp->ep->bits_per_sec = 9600;
+		lp->ep->rx_priv = lp;
+		lp->ep->rx_func = tmx_rx_notify;
+	}
+
+	tp->i_dev->priv = tp;
+	tp->i_dev->io_func = dev_tmxi_iofunc;
+	cpu_add_dev(tp->i_dev, NULL);
+
+	tp->o_dev->priv = tp;
+	tp->o_dev->io_func = dev_tmxo_iofunc;
+	cpu_add_dev(tp->o_dev, NULL);
+	return (tp);
+}
+
+void v_matchproto_(cli_func_f)
+cli_tmx(struct cli *cli)
+{
+	struct io_tmx *tp;
+	int line;
+
+	if (cli->help) {
+		cli_io_help(cli, "TMXI+TMXO 64 line multiplexor", 1, 0);
+		cli_printf(cli, "\tline <0…63> <elastic>\n");
+		cli_printf(cli, "\t\tPer line elastic buffer arguments\n");
+		return;
+	}
+
+	cli->ac--;
+	cli->av++;
+	tp = cli_dev_get_unit(cli, "TMXI", "TMXO", new_tmx);
+	if (tp == NULL)
+		return;
+
+	while (cli->ac && !cli->status) {
+		if (cli_dev_trace(tp->i_dev, cli)) {
+			tp->o_dev->trace = tp->i_dev->trace;
+			continue;
+		}
+		if (!strcasecmp(*cli->av, "line")) {
+			if (cli->ac < 2) {
+				(void)cli_n_args(cli, 1);
+				return;
+			}
+			line = atoi(cli->av[1]);
+			if (line < 0 || line >= TMX_NLINE) {
+				cli_error(cli,
+				    "line number out of range [0…63]\n");
+				return;
+			}
+			cli->ac -= 2;
+			cli->av += 2;
+			if (!cli->ac)
+				continue;
+			if (cli_elastic(tp->lines[line].ep, cli))
+				continue;
+			cli_unknown(cli);
+			return;
+		}
+		cli_unknown(cli);
+		break;
+	}
+}
@@ -29,15 +29,18 @@
  *
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include "rc3600.h"
 #include "elastic.h"
 
 struct io_tty {
 	struct elastic		*ep;
+	struct elastic		*echo;
 	struct iodev		*i_dev;
 	struct iodev		*o_dev;
 };
@@ -49,10 +52,12 @@ dev_tti_thread(void *priv)
 	struct io_tty *tp = iod->priv;
 	uint8_t buf[1];
 	ssize_t sz;
+	nanosec d;
 
 	while (1) {
-		if (tp->ep->bits_per_sec > 0)
-			callout_dev_sleep(iod, nsec_per_char(tp->ep));
+		d = elastic_rx_delay(tp->ep, 1);
+		if (d > 0)
+			callout_dev_sleep(iod, d);
 		sz = elastic_get(tp->ep, buf, 1);
 		assert(sz == 1);
 		AZ(pthread_mutex_lock(&iod->mtx));
@@ -67,6 +72,72 @@ dev_tti_thread(void *priv)
 	}
 }
 
+/*
+ * The console echo goes through its own elastic buffer, so the CPU
+ * thread does not pay a write(2) per character.
+ */
+
+static void
+tty_echo(const struct io_tty *tp, uint8_t c)
+{
+	char buf[16];
+
+	switch (c) {
+	case 0x00:
+		return;
+	case 0x0a:
+	case 0x0d:
+		bprintf(buf, "%c", c);
+		break;
+	default:
+		if (c < 0x20)
+			bprintf(buf, "\x1b[1m»%02x«\x1b[m", c);
+		else
+			bprintf(buf, "\x1b[1m%c\x1b[m", c);
+		break;
+	}
+	elastic_put(tp->echo, buf, -1);
+}
+
+/*
+ * The echo is written from the elastic loop thread, so it must be
+ * non-blocking, or a stalled stdout would hold up all other I/O.
+ * Opening the terminal or /dev/fd/1 again gives a file description of
+ * its own, where dup(2) would share the non-blocking flag with stdout,
+ * and on a terminal usually with stdin as well, and then the CLI would
+ * see EAGAIN.  If we cannot get one of our own, we fall back to the
+ * old blocking behaviour, except for plain files, which never block.
+ */
+
+static int
+tty_echo_stdout(struct io_tty *tp)
+{
+	int fd, fl;
+	const char *tty;
+	struct stat st;
+
+	fl = fcntl(STDOUT_FILENO, F_GETFL);
+	if (fl == -1)
+		return (-1);
+	tty = isatty(STDOUT_FILENO) ? ttyname(STDOUT_FILENO) : NULL;
+	if (tty != NULL)
+		fd = open(tty, O_WRONLY | O_NOCTTY);
+	else
+		fd = open("/dev/fd/1", O_WRONLY);
+	if (fd < 0)
+		fd = dup(STDOUT_FILENO);
+	if (fd < 0)
+		return (-1);
+	if (tp->echo->out != NULL)
+		elastic_fd_stop(&tp->echo->out);
+	tp->echo->out = elastic_fd_start(tp->echo, fd, O_WRONLY, 0);
+	if (!(fl & O_NONBLOCK) &&
+	    (fcntl(STDOUT_FILENO, F_GETFL) & O_NONBLOCK) &&
+	    (fstat(fd, &st) || !S_ISREG(st.st_mode)))
+		AZ(fcntl(fd, F_SETFL, fl));
+	return (0);
+}
+
 static void
 dev_tto_iofunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
 {
@@ -80,23 +151,9 @@ dev_tto_iofunc(struct iodev *iop, uint16_t ioi, uint16_t *reg)
 		AZ(iop->done);
 		buf[0] = iop->oreg_a & 0x7f;
 		elastic_put(tp->ep, buf, 1);
-		switch (buf[0]) {
-		case 0x00:
-			break;
-		case 0x0a:
-			printf("%c", buf[0]);
-			break;
-		case 0x0d:
-			printf("%c", buf[0]);
-			break;
-		default:
-			if (buf[0] < 0x20)
-				printf("\x1b[1m»%02x«\x1b[m", buf[0]);
-			else
-				printf("\x1b[1m%c\x1b[m", buf[0]);
-			break;
-		}
-		callout_dev_is_done(iop, nsec_per_char(tp->ep));
+		if (tp->echo->out != NULL)
+			tty_echo(tp, buf[0]);
+		callout_dev_is_done(iop, elastic_tx_delay(tp->ep, 1));
 	}
 }
 
@@ -115,6 +172,10 @@ new_tty(struct iodev *iop1, struct iodev *iop2)
 	AN(tp->ep);
 	tp->ep->bits_per_char = 11;
 	tp->ep->bits_per_sec = 2400;
+	tp->echo = elastic_new(tp->i_dev->cs, O_WRONLY);
+	AN(tp->echo);
+	tp->echo->text = 0;
+	(void)tty_echo_stdout(tp);
 
 	tp->i_dev->priv = tp;
 	cpu_add_dev(tp->i_dev, dev_tti_thread);
@@ -133,6 +194,8 @@ cli_tty(struct cli *cli)
 
 	if (cli->help) {
 		cli_io_help(cli, "TTI+TTO device pair", 1, 1);
+		cli_printf(cli, "\techo {on|off|> <filename>|>> <filename>}\n");
+		cli_printf(cli, "\t\tConsole echo of output to stdout, nowhere or file\n");
 		return;
 	}
 
@@ -147,6 +210,34 @@ cli_tty(struct cli *cli)
 			tp->o_dev->trace = tp->i_dev->trace;
 			continue;
 		}
+		if (!strcasecmp(*cli->av, "echo")) {
+			if (cli->ac < 2) {
+				(void)cli_n_args(cli, 1);
+				return;
+			}
+			cli->ac--;
+			cli->av++;
+			if (!strcmp(*cli->av, ">") || !strcmp(*cli->av, ">>")) {
+				(void)cli_elastic_fd(tp->echo, cli);
+				continue;
+			}
+			if (!strcasecmp(*cli->av, "on")) {
+				if (tty_echo_stdout(tp)) {
+					cli_error(cli, "Cannot dup stdout: %s\n",
+					    strerror(errno));
+					return;
+				}
+			} else if (!strcasecmp(*cli->av, "off")) {
+				if (tp->echo->out != NULL)
+					elastic_fd_stop(&tp->echo->out);
+			} else {
+				cli_unknown(cli);
+				return;
+			}
+			cli->ac--;
+			cli->av++;
+			continue;
+		}
 		if (cli_elastic(tp->ep, cli))
 			continue;
 		cli_unknown(cli);
@@ -0,0 +1,165 @@
+/*-
+ * Copyright (c) 2005-2020 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Per-drive I/O statistics for the disk controllers.
+ *
+ * All times are simulated time.  The controllers update the counters
+ * with iop->mtx held, and the CLI reads them the same way.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "rc3600.h"
+
+void
+iostats_reset(struct iostats *is, nanosec t)
+{
+
+	memset(is, 0, sizeof *is);
+	is->t0 = t;
+}
+
+static unsigned
+iostats_log2(uint64_t v, unsigned nbucket)
+{
+	unsigned u = 0;
+
+	while (v > 1 && u < nbucket - 1) {
+		v >>= 1;
+		u++;
+	}
+	return (u);
+}
+
+void
+iostats_seek(struct iostats *is, unsigned dist)
+{
+
+	is->seeks++;
+	is->seek_hist[dist ? 1 + iostats_log2(dist, IOS_SEEK_HIST - 1) : 0]++;
+}
+
+void
+iostats_start(struct iostats *is, nanosec t)
+{
+
+	is->start = t;
+	is->active = 1;
+}
+
+void
+iostats_done(struct iostats *is, nanosec t, int wr, unsigned nsect)
+{
+	nanosec d;
+
+	if (!is->active || t < is->start)
+		return;
+	d = t - is->start;
+	is->active = 0;
+	if (wr) {
+		is->writes++;
+		is->sect_written += nsect;
+	} else {
+		is->reads++;
+		is->sect_read += nsect;
+	}
+	is->busy += d;
+	if (d > is->lat_max)
+		is->lat_max = d;
+	is->lat_hist[iostats_log2(d / 1000, IOS_LAT_HIST)]++;
+}
+
+/*
+ * Human readable, or with 'raw' one "<dev>.<drive>.<counter> <value>"
+ * per line, values in nanoseconds.
+ */
+
+void
+iostats_cli(struct cli *cli, const struct iodev *iop, unsigned drive,
+    const struct iostats *is, nanosec t, int raw)
+{
+	nanosec el;
+	unsigned u;
+	uint64_t n;
+
+	el = t - is->t0;
+	n = is->reads + is->writes;
+	if (raw) {
+#define R(fld, val)							\
+	cli_printf(cli, "%s.%u." fld " %ju\n", iop->name, drive, (uintmax_t)(val))
+		R("reads", is->reads);
+		R("writes", is->writes);
+		R("sectors_read", is->sect_read);
+		R("sectors_written", is->sect_written);
+		R("seeks", is->seeks);
+		R("busy", is->busy);
+		R("elapsed", el);
+		R("latency_max", is->lat_max);
+		for (u = 0; u < IOS_SEEK_HIST; u++)
+			cli_printf(cli, "%s.%u.seek_ge_%u %ju\n",
+			    iop->name, drive, u ? 1U << (u - 1) : 0,
+			    (uintmax_t)is->seek_hist[u]);
+		for (u = 0; u < IOS_LAT_HIST; u++)
+			cli_printf(cli, "%s.%u.latency_ge_%ju %ju\n",
+			    iop->name, drive, u ? (uintmax_t)1000 << u : 0,
+			    (uintmax_t)is->lat_hist[u]);
+#undef R
+		return;
+	}
+	cli_printf(cli, "%s drive %u:\n", iop->name, drive);
+	cli_printf(cli, "\t%ju reads (%ju sectors), %ju writes (%ju sectors)\n",
+	    (uintmax_t)is->reads, (uintmax_t)is->sect_read,
+	    (uintmax_t)is->writes, (uintmax_t)is->sect_written);
+	cli_printf(cli, "\tbusy %.1f%% of %.3f s, latency avg %.3f max %.3f ms\n",
+	    el > 0 ? 100. * is->busy / el : 0., el * 1e-9,
+	    n ? is->busy * 1e-6 / n : 0., is->lat_max * 1e-6);
+	cli_printf(cli, "\t%ju seeks\n", (uintmax_t)is->seeks);
+	for (u = 0; u < IOS_SEEK_HIST; u++) {
+		if (!is->seek_hist[u])
+			continue;
+		if (u < 2)
+			cli_printf(cli, "\t\t%7u cyl\t%ju\n",
+			    u, (uintmax_t)is->seek_hist[u]);
+		else
+			cli_printf(cli, "\t\t%3u-%-3u cyl\t%ju\n",
+			    1U << (u - 1), (1U << u) - 1,
+			    (uintmax_t)is->seek_hist[u]);
+	}
+	for (u = 0; u < IOS_LAT_HIST; u++) {
+		if (!is->lat_hist[u])
+			continue;
+		cli_printf(cli, "\t\t%s%9.3f ms\t%ju\n",
+		    u == IOS_LAT_HIST - 1 ? ">=" : "< ",
+		    u == IOS_LAT_HIST - 1 ? (1 << u) * 1e-3 : (2 << u) * 1e-3,
+		    (uintmax_t)is->lat_hist[u]);
+	}
+}
@@ -0,0 +1,400 @@
+/*-
+ * Copyright (c) 2005-2020 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Crash-safe write-back of disk images which are mapped privately.
+ *
+ * The controller marks sectors dirty after it has written them.  A
+ * thread per image appends the dirty sectors to a journal file and
+ * fsync(2)s it every JOURNAL_SYNC, then every JOURNAL_FOLD records
+ * writes the journaled sectors into the image file, fsync(2)s it and
+ * empties the journal.  A journal which is not empty when it is opened
+ * is left over from a crash, and is folded into the image first.
+ *
+ * Records are a 16 byte header (magic, sector, sequence, checksum)
+ * followed by the sector, a torn record at the end fails the checksum
+ * and is ignored.
+ *
+ * Write errors, a full disk for instance, are reported once.  The
+ * sectors stay dirty or logged, and the thread tries again next time.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/endian.h>
+#include "rc3600.h"
+
+#define JOURNAL_SYNC	100000000	// nsec
+#define JOURNAL_FOLD	1024		// records
+#define JOURNAL_MAGIC	0x444b504a	// "DKPJ"
+#define JOURNAL_HDR	16
+
+struct journal {
+	TAILQ_ENTRY(journal)	list;
+	uint8_t			*img;
+	char			*jfn;
+	unsigned		nsect;
+	unsigned		bps;
+	int			jfd;
+	int			ifd;
+	uint32_t		seq;
+	unsigned		nrec;
+	int			failed;
+
+	pthread_t		thread;
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+	int			stop;
+	uint8_t			*dirty;		/* bitmap */
+	uint8_t			*logged;	/* bitmap, writer only */
+	unsigned		*list_buf;
+	uint8_t			*rec_buf;
+};
+
+static pthread_once_t journal_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t journal_mtx = PTHREAD_MUTEX_INITIALIZER;
+static TAILQ_HEAD(, journal) journals = TAILQ_HEAD_INITIALIZER(journals);
+
+static uint32_t
+journal_sum(const uint8_t *hdr, const uint8_t *p, unsigned len)
+{
+	uint32_t a = 1, b = 0;
+	unsigned u;
+
+	/* Adler-32 over the sector and sequence numbers and the data */
+	for (u = 4; u < 12; u++) {
+		a = (a + hdr[u]) % 65521;
+		b = (b + a) % 65521;
+	}
+	for (u = 0; u < len; u++) {
+		a = (a + p[u]) % 65521;
+		b = (b + a) % 65521;
+	}
+	return ((b << 16) | a);
+}
+
+static int
+journal_error(struct journal *jp, const char *what)
+{
+
+	if (!jp->failed)
+		fprintf(stderr, "Journal %s: %s failed: %s, will retry\n",
+		    jp->jfn, what, strerror(errno));
+	jp->failed = 1;
+	return (-1);
+}
+
+static int
+journal_fold(struct journal *jp)
+{
+	unsigned u;
+
+	for (u = 0; u < jp->nsect; u++) {
+		if (!(jp->logged[u >> 3] & (1 << (u & 7))))
+			continue;
+		if (pwrite(jp->ifd, jp->img + u * jp->bps, jp->bps,
+		    (off_t)u * jp->bps) != (ssize_t)jp->bps)
+			return (journal_error(jp, "Image write"));
+	}
+	if (fsync(jp->ifd))
+		return (journal_error(jp, "Image fsync"));
+	if (ftruncate(jp->jfd, 0) || fsync(jp->jfd))
+		return (journal_error(jp, "Truncate"));
+	memset(jp->logged, 0, (jp->nsect + 7) / 8);
+	jp->nrec = 0;
+	return (0);
+}
+
+/*
+ * Append the dirty sectors to the journal, returns number of records.
+ * If that fails, the journal is cut back to the last good record and
+ * the sectors are marked dirty again.
+ */
+
+static unsigned
+journal_sync(struct journal *jp)
+{
+	unsigned n = 0, u, v;
+	uint8_t *hdr;
+	const size_t rs = JOURNAL_HDR + jp->bps;
+	ssize_t sz;
+
+	AZ(pthread_mutex_lock(&jp->mtx));
+	for (u = 0; u < jp->nsect; u++) {
+		if (jp->dirty[u >> 3] & (1 << (u & 7))) {
+			jp->dirty[u >> 3] &= ~(1 << (u & 7));
+			jp->list_buf[n++] = u;
+		}
+	}
+	AZ(pthread_mutex_unlock(&jp->mtx));
+	if (n == 0)
+		return (0);
+	hdr = jp->rec_buf;
+	for (v = 0; v < n; v++) {
+		u = jp->list_buf[v];
+		be32enc(hdr, JOURNAL_MAGIC);
+		be32enc(hdr + 4, u);
+		be32enc(hdr + 8, jp->seq++);
+		memcpy(hdr + JOURNAL_HDR, jp->img + u * jp->bps, jp->bps);
+		be32enc(hdr + 12,
+		    journal_sum(hdr, hdr + JOURNAL_HDR, jp->bps));
+		sz = write(jp->jfd, hdr, rs);
+		if (sz != (ssize_t)rs) {
+			if (sz >= 0)
+				errno = ENOSPC;	/* Short write */
+			break;
+		}
+		jp->logged[u >> 3] |= 1 << (u & 7);
+	}
+	if (v == n && !fsync(jp->jfd)) {
+		jp->nrec += n;
+		return (n);
+	}
+	(void)journal_error(jp, v < n ? "Write" : "Fsync");
+	(void)ftruncate(jp->jfd, (off_t)jp->nrec * rs);
+	AZ(pthread_mutex_lock(&jp->mtx));
+	for (v = 0; v < n; v++) {
+		u = jp->list_buf[v];
+		jp->dirty[u >> 3] |= 1 << (u & 7);
+	}
+	AZ(pthread_mutex_unlock(&jp->mtx));
+	return (0);
+}
+
+static void *
+journal_thread(void *priv)
+{
+	struct journal *jp = priv;
+	struct timespec ts;
+	nanosec t;
+
+	AZ(pthread_mutex_lock(&jp->mtx));
+	while (!jp->stop) {
+		t = now() + JOURNAL_SYNC;
+		ts.tv_sec = t / 1000000000;
+		ts.tv_nsec = t % 1000000000;
+		(void)pthread_cond_timedwait(&jp->cond, &jp->mtx, &ts);
+		AZ(pthread_mutex_unlock(&jp->mtx));
+		if (journal_sync(jp) == 0 && jp->nrec > 0)
+			(void)journal_fold(jp);	/* Quiet, catch up */
+		else if (jp->nrec >= JOURNAL_FOLD)
+			(void)journal_fold(jp);
+		AZ(pthread_mutex_lock(&jp->mtx));
+	}
+	AZ(pthread_mutex_unlock(&jp->mtx));
+	return (NULL);
+}
+
+/*
+ * Stop the writer thread and write everything out.
+ */
+
+static void
+journal_stop(struct journal *jp)
+{
+
+	AZ(pthread_mutex_lock(&jp->mtx));
+	jp->stop = 1;
+	AZ(pthread_cond_signal(&jp->cond));
+	AZ(pthread_mutex_unlock(&jp->mtx));
+	AZ(pthread_join(jp->thread, NULL));
+	(void)journal_sync(jp);
+	(void)journal_fold(jp);
+}
+
+static void
+journal_atexit(void)
+{
+	struct journal *jp;
+
+	AZ(pthread_mutex_lock(&journal_mtx));
+	while (!TAILQ_EMPTY(&journals)) {
+		jp = TAILQ_FIRST(&journals);
+		TAILQ_REMOVE(&journals, jp, list);
+		journal_stop(jp);
+	}
+	AZ(pthread_mutex_unlock(&journal_mtx));
+}
+
+static void
+journal_init(void)
+{
+
+	AZ(atexit(journal_atexit));
+}
+
+/*
+ * Fold a journal left over from a crash into the image file.
+ */
+
+static int
+journal_replay(struct journal *jp)
+{
+	uint8_t *hdr = jp->rec_buf;
+	unsigned sect, n = 0;
+
+	AZ(lseek(jp->jfd, 0, SEEK_SET));
+	while (read(jp->jfd, hdr, JOURNAL_HDR + jp->bps) ==
+	    (ssize_t)(JOURNAL_HDR + jp->bps)) {
+		sect = be32dec(hdr + 4);
+		if (be32dec(hdr) != JOURNAL_MAGIC || sect >= jp->nsect ||
+		    be32dec(hdr + 12) !=
+		    journal_sum(hdr, hdr + JOURNAL_HDR, jp->bps))
+			break;
+		if (pwrite(jp->ifd, hdr + JOURNAL_HDR, jp->bps,
+		    (off_t)sect * jp->bps) != (ssize_t)jp->bps)
+			return (-1);
+		n++;
+	}
+	if (fsync(jp->ifd) || ftruncate(jp->jfd, 0) || fsync(jp->jfd))
+		return (-1);
+	return (n);
+}
+
+/*
+ * img must be a private mapping of the image file, which is remapped
+ * by the caller if anything was replayed (return value > 0).
+ */
+
+static void
+journal_free(struct journal *jp)
+{
+
+	AZ(close(jp->jfd));
+	AZ(close(jp->ifd));
+	free(jp->jfn);
+	free(jp->dirty);
+	free(jp->logged);
+	free(jp->list_buf);
+	free(jp->rec_buf);
+	free(jp);
+}
+
+int
+journal_new(struct journal **jpp, struct cli *cli, const char *jfn,
+    const char *ifn, uint8_t *img, unsigned nsect, unsigned bps)
+{
+	struct journal *jp;
+	int n;
+
+	AN(jpp);
+	AZ(*jpp);
+	jp = calloc(1, sizeof *jp);
+	AN(jp);
+	jp->img = img;
+	jp->jfn = strdup(jfn);
+	AN(jp->jfn);
+	jp->nsect = nsect;
+	jp->bps = bps;
+	jp->ifd = open(ifn, O_WRONLY);
+	if (jp->ifd < 0) {
+		(void)cli_error(cli, "Cannot open %s: %s\n",
+		    ifn, strerror(errno));
+		free(jp->jfn);
+		free(jp);
+		return (-1);
+	}
+	jp->jfd = open(jfn, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (jp->jfd < 0) {
+		(void)cli_error(cli, "Cannot open %s: %s\n",
+		    jfn, strerror(errno));
+		AZ(close(jp->ifd));
+		free(jp->jfn);
+		free(jp);
+		return (-1);
+	}
+	jp->dirty = calloc(1, (nsect + 7) / 8);
+	AN(jp->dirty);
+	jp->logged = calloc(1, (nsect + 7) / 8);
+	AN(jp->logged);
+	jp->list_buf = calloc(nsect, sizeof *jp->list_buf);
+	AN(jp->list_buf);
+	jp->rec_buf = malloc(JOURNAL_HDR + bps);
+	AN(jp->rec_buf);
+
+	n = journal_replay(jp);
+	if (n < 0) {
+		(void)cli_error(cli, "Cannot replay %s: %s\n",
+		    jfn, strerror(errno));
+		journal_free(jp);
+		return (-1);
+	}
+	if (n > 0)
+		cli_printf(cli, "Replayed %d sectors from %s\n", n, jfn);
+
+	AZ(pthread_mutex_init(&jp->mtx, NULL));
+	AZ(pthread_cond_init(&jp->cond, NULL));
+	AZ(pthread_create(&jp->thread, NULL, journal_thread, jp));
+	AZ(pthread_once(&journal_once, journal_init));
+	AZ(pthread_mutex_lock(&journal_mtx));
+	TAILQ_INSERT_TAIL(&journals, jp, list);
+	AZ(pthread_mutex_unlock(&journal_mtx));
+	*jpp = jp;
+	return (n);
+}
+
+void
+journal_dirty(struct journal *jp, unsigned sect)
+{
+
+	assert(sect < jp->nsect);
+	AZ(pthread_mutex_lock(&jp->mtx));
+	jp->dirty[sect >> 3] |= 1 << (sect & 7);
+	AZ(pthread_mutex_unlock(&jp->mtx));
+}
+
+void
+journal_destroy(struct journal **jpp)
+{
+	struct journal *jp, *jp2;
+
+	AN(jpp);
+	jp = *jpp;
+	*jpp = NULL;
+	AN(jp);
+	AZ(pthread_mutex_lock(&journal_mtx));
+	TAILQ_FOREACH(jp2, &journals, list)
+		if (jp2 == jp)
+			break;
+	if (jp2 != NULL) {
+		TAILQ_REMOVE(&journals, jp, list);
+		journal_stop(jp);
+	}
+	AZ(pthread_mutex_unlock(&journal_mtx));
+	AZ(pthread_mutex_destroy(&jp->mtx));
+	AZ(pthread_cond_destroy(&jp->cond));
+	journal_free(jp);
+}
@@ -31,6 +31,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
@@ -114,6 +115,9 @@ main(int argc, char **argv)
 	setbuf(stdout, NULL);
 	setbuf(stderr, NULL);
 
+	/* Sockets and pipes come and go, a write to a closed one fails */
+	(void)signal(SIGPIPE, SIG_IGN);
+
 	cs = cpu_new();
 	AN(cs);
 
@@ -69,6 +69,7 @@ struct rc3600 {
 	pthread_t		cthread;
 
 	int			running;
+	int			dying;
 	uint16_t		acc[4];		/* The accumulators */
 	uint16_t		carry;		/* Carry bit */
 	uint16_t		pc;		/* Program counter */
@@ -115,6 +116,7 @@ struct rc3600 {
 ins_exec_f rc3600_exec;
 
 struct rc3600 *cpu_new(void);
+void cpu_destroy(struct rc3600 *cs);
 void cpu_add_dev(struct iodev *iop, iodev_thr *thr);
 void cpu_start(struct rc3600 *);
 void cpu_stop(struct rc3600 *cs);
@@ -173,6 +175,7 @@ void dev_trace(const struct iodev *iop, const char *fmt, ...) __printflike(2, 3)
 #define CORE_DATA	(1<<7)
 
 struct core *core_new(void);
+void core_free(struct core *);
 
 uint16_t core_read(struct rc3600 *, uint16_t addr, int how);
 void core_write(struct rc3600 *, uint16_t addr, uint16_t val, int how);
@@ -206,8 +209,46 @@ void callout_dev_sleep(struct iodev *, nanosec);
 void callout_dev_sleep_locked(struct iodev *, nanosec);
 void callout_dev_is_done(struct iodev *iop, nanosec when);
 void callout_dev_is_done_abs(struct iodev *iop, nanosec when);
+typedef void callout_cb_f(void *priv, nanosec when);
+void callout_callback(struct rc3600 *, nanosec when, callout_cb_f *, void *);
 
 nanosec callout_poll(struct rc3600 *cs);
+void callout_flush(struct rc3600 *cs);
+
+/* Drive statistics ***************************************************/
+
+#define IOS_SEEK_HIST	9	/* 0, 1, 2-3, ... 128-255 cylinders */
+#define IOS_LAT_HIST	18	/* 2^n microseconds */
+
+struct iostats {
+	uint64_t		reads;
+	uint64_t		writes;
+	uint64_t		sect_read;
+	uint64_t		sect_written;
+	uint64_t		seeks;
+	uint64_t		seek_hist[IOS_SEEK_HIST];
+	uint64_t		lat_hist[IOS_LAT_HIST];
+	nanosec			lat_max;
+	nanosec			busy;
+	nanosec			t0;
+	nanosec			start;
+	int			active;
+};
+
+void iostats_reset(struct iostats *, nanosec);
+void iostats_seek(struct iostats *, unsigned dist);
+void iostats_start(struct iostats *, nanosec);
+void iostats_done(struct iostats *, nanosec, int wr, unsigned nsect);
+void iostats_cli(struct cli *, const struct iodev *, unsigned drive,
+    const struct iostats *, nanosec, int raw);
+
+/* Disk image journal *************************************************/
+
+struct journal;
+int journal_new(struct journal **, struct cli *, const char *jfn,
+    const char *ifn, uint8_t *img, unsigned nsect, unsigned bps);
+void journal_dirty(struct journal *, unsigned sect);
+void journal_destroy(struct journal **);
 
 /* IO device interface ************************************************/
 
@@ -312,6 +353,7 @@ struct ins_timing {
 /* AUTOROM ************************************************************/
 
 void AutoRom(struct rc3600 *cs);
+int tape_load(struct rc3600 *, struct cli *, const char *fn, uint16_t *start);
 
 /* I/O DRIVERS ********************************************************/
 
@@ -324,6 +366,11 @@ cli_func_f cli_ptr;
 cli_func_f cli_fdd;
 cli_func_f cli_amx;
 cli_func_f cli_cdr;
+cli_func_f cli_tmx;
+cli_func_f cli_lpt;
+cli_func_f cli_mt;
+cli_func_f cli_hft;
+cli_func_f cli_fpa;
 cli_func_f cli_domus;
 cli_func_f cli_nodev;
 